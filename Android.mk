@@ -15,7 +15,20 @@ LOCAL_SRC_FILES := \
 	sanity.c \
 	keystore.c \
 	asn1.c \
-	hashes.c
+	hashes.c \
+	sparse_stream.c \
+	flash_stream.c \
+	buf_ring.c \
+	usb_aio.c \
+	udp.c \
+	image_writer.c \
+	decompress.c \
+	blkwriter.c \
+	verifier.c \
+	data_window.c \
+	erase.c \
+	erase_queue.c \
+	format.c
 
 LOCAL_CFLAGS := -DDEVICE_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\" \
 	-W -Wall -Wextra -Wno-unused-parameter -Wno-format-zero-length -Werror
@@ -46,6 +46,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/input.h>
 #include <sys/utsname.h>
 #include <sys/klog.h>
@@ -71,6 +72,11 @@
 #include "sanity.h"
 #include "keystore.h"
 #include "hashes.h"
+#include "flash_stream.h"
+#include "format.h"
+#include "erase_queue.h"
+#include "sparse_stream.h"
+#include "decompress.h"
 
 /* Generated by the makefile, this function defines the
  * register_userfastboot_plugins() function, which calls all the
@@ -160,6 +166,8 @@ struct flash_target {
 struct cmd_struct {
 	void *callback;
 	enum device_state min_state;
+	bool query;
+	bool windowed;
 };
 
 Hashmap *flash_cmds;
@@ -570,6 +578,11 @@ static int set_device_state(enum device_state device_state)
 	}
 	must_erase = is_valid_blkdev(vol->blk_device) && !is_provisioning_mode();
 
+	if (must_erase && erase_queue_busy(NULL)) {
+		pr_error("wait for background erases to finish\n");
+		return -1;
+	}
+
 	if (must_erase) {
 #ifdef USERDEBUG
 #ifdef USER
@@ -582,7 +595,7 @@ static int set_device_state(enum device_state device_state)
 		pr_status("Userdata erase required, this can take a while...\n");
 		fastboot_info("Userdata erase required, this can take a while...\n");
 
-		if (erase_partition(vol)) {
+		if (wipe_partition(vol)) {
 			pr_error("couldn't erase data partition\n");
 			return -1;
 		}
@@ -682,6 +695,8 @@ static int aboot_register_cmd(Hashmap *map, char *key, void *callback,
 	cs = xmalloc(sizeof(*cs));
 	cs->callback = callback;
 	cs->min_state = min_state;
+	cs->query = false;
+	cs->windowed = false;
 
 	hashmapPut(map, k, cs);
 	pr_verbose("Registered plugin function %p (%s) with table %p\n",
@@ -696,11 +711,34 @@ int aboot_register_flash_cmd(char *key, flash_func callback, enum device_state m
 	return ret;
 }
 
+int aboot_register_flash_window_cmd(char *key, flash_window_func callback,
+		enum device_state min_state)
+{
+	struct cmd_struct *cs;
+
+	if (aboot_register_cmd(flash_cmds, key, callback, min_state))
+		return -1;
+	cs = hashmapGet(flash_cmds, key);
+	cs->windowed = true;
+	return 0;
+}
+
 int aboot_register_oem_cmd(char *key, oem_func callback, enum device_state min_state)
 {
 	return aboot_register_cmd(oem_cmds, key, callback, min_state);
 }
 
+int aboot_register_oem_query(char *key, oem_func callback, enum device_state min_state)
+{
+	struct cmd_struct *cs;
+
+	if (aboot_register_cmd(oem_cmds, key, callback, min_state))
+		return -1;
+	cs = hashmapGet(oem_cmds, key);
+	cs->query = true;
+	return 0;
+}
+
 
 static int set_keystore_data(void *data, unsigned sz)
 {
@@ -731,22 +769,39 @@ static int set_keystore_data(void *data, unsigned sz)
 }
 
 
-/* Erase a named partition by creating a new empty partition on top of
- * its device node. No parameters. */
-static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
+/* Why the named partition can't be erased right now, or NULL if it
+ * can be */
+static const char *erase_denied(char *part_name)
 {
-	struct fstab_rec *vol;
 	enum device_state current_state;
 
 	current_state = get_device_state();
-	if (current_state == LOCKED) {
-		fastboot_fail("bootloader must not be locked");
-		return;
-	}
+	if (current_state == LOCKED)
+		return "bootloader must not be locked";
 
 	if (current_state == VERIFIED &&
-			!hashmapContainsKey(erase_whitelist, part_name)) {
-		fastboot_fail("can't erase this in 'verified' state");
+			!hashmapContainsKey(erase_whitelist, part_name))
+		return "can't erase this in 'verified' state";
+
+	if (erase_queue_busy(part_name))
+		return "partition is being erased in the background";
+
+	if (flash_stream_pending(part_name))
+		return "partition has a streamed flash pending";
+
+	return NULL;
+}
+
+/* Erase a named partition by creating a new empty partition on top of
+ * its device node. No parameters. */
+static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
+{
+	struct fstab_rec *vol;
+	const char *denied;
+
+	denied = erase_denied(part_name);
+	if (denied) {
+		fastboot_fail("%s", denied);
 		return;
 	}
 
@@ -772,6 +827,33 @@ static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
 
 }
 
+/* Erase a named partition and make an empty ext4 filesystem on it in
+ * place, rather than flashing one generated on the host. No
+ * parameters. */
+static void cmd_format(char *part_name, int fd, void *data, unsigned sz)
+{
+	struct fstab_rec *vol;
+	const char *denied;
+
+	denied = erase_denied(part_name);
+	if (denied) {
+		fastboot_fail("%s", denied);
+		return;
+	}
+
+	vol = volume_for_name(part_name);
+	if (vol == NULL) {
+		fastboot_fail("unknown partition name");
+		return;
+	}
+
+	pr_status("Formatting %s...\n", part_name);
+	if (format_partition(vol))
+		fastboot_fail("Can't format partition");
+	else
+		fastboot_okay("");
+}
+
 /* Image command. Allows user to send a single file which
  * will be written to a destination location. Typical
  * usage is to write to a disk device node, in order to flash a raw
@@ -787,19 +869,33 @@ static void cmd_erase(char *part_name, int fd, void *data, unsigned sz)
  * delimited from the target name by a colon. Each parameter is either
  * a simple string (for flags) or param=value.
  *
+ * Parameters understood for partitions:
+ * discard : Discard the areas a sparse image leaves unspecified
+ * delta   : Read the partition first and only write blocks that differ
+ * verify  : Read back what was written while flashing and compare
+ *
  */
 static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 {
 	struct flash_target tgt;
-	flash_func cb;
 	struct cmd_struct *cs;
 	int ret;
         struct fstab_rec *vol;
 	uint64_t vsize;
 	uint32_t magic = 0;
 	enum device_state current_state;
+	unsigned flags = 0;
+	struct data_window *dw = fastboot_download_data();
+	struct sparse_header sh;
+	size_t head_len;
 
 	process_target(targetspec, &tgt);
+	if (hashmapContainsKey(tgt.params, "discard"))
+		flags |= IMAGE_DISCARD;
+	if (hashmapContainsKey(tgt.params, "delta"))
+		flags |= IMAGE_DELTA;
+	if (hashmapContainsKey(tgt.params, "verify"))
+		flags |= IMAGE_VERIFY;
 
 	current_state = get_device_state();
 
@@ -816,9 +912,31 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 			goto out;
 		}
 
-		cb = (flash_func)cs->callback;
+		/* These can rewrite anything, partition tables included */
+		if (erase_queue_busy(NULL)) {
+			fastboot_fail("wait for background erases to finish");
+			goto out;
+		}
+
+		if (flash_stream_pending(NULL)) {
+			fastboot_fail("a streamed flash is pending");
+			goto out;
+		}
 
-		cbret = cb(tgt.params, fd, data, sz);
+		if (cs->windowed) {
+			cbret = ((flash_window_func)cs->callback)(tgt.params,
+					dw);
+		} else {
+			/* Older handlers want all of it mapped */
+			data = sz ? (void *)data_window_map(dw, 0, sz) : NULL;
+			if (sz && !data) {
+				fastboot_fail("download too big for %s",
+						tgt.name);
+				goto out;
+			}
+			cbret = ((flash_func)cs->callback)(tgt.params, fd,
+					data, sz);
+		}
 		if (cbret) {
 			pr_error("%s flash failed!\n", tgt.name);
 			fastboot_fail("%s", tgt.name);
@@ -844,6 +962,18 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
+	if (erase_queue_busy(tgt.name)) {
+		fastboot_fail("%s is being erased in the background", tgt.name);
+		goto out;
+	}
+
+	/* Finished streamed flashes are claimed below, but one that hasn't
+	 * got its data yet may belong to another session */
+	if (flash_stream_pending(tgt.name)) {
+		fastboot_fail("%s has a streamed flash pending", tgt.name);
+		goto out;
+	}
+
 	if (!is_valid_blkdev(vol->blk_device)) {
 		fastboot_fail("invalid destination node. partition disks?");
 		goto out;
@@ -853,17 +983,27 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
+	/* Data may already have been written by 'oem stream-flash' */
+	ret = flash_stream_claim(tgt.name, sz != 0);
+	if (ret) {
+		if (ret < 0)
+			fastboot_fail("streamed flash failed");
+		else
+			fastboot_okay("");
+		goto out;
+	}
+
 	if (!strcmp(targetspec, "fastboot") ||
 	    !strcmp(targetspec, "recovery") ||
 	    !strcmp(targetspec, "boot")) {
-		if (bootimage_sanity_checks(data, sz)) {
+		if (bootimage_sanity_checks(dw)) {
 			fastboot_fail("malformed AOSP boot image, refusing to flash!");
 			goto out;
 		}
 	}
 
 	if (!strcmp(targetspec, "bootloader")) {
-		if (esp_sanity_checks(FASTBOOT_DOWNLOAD_TMP_FILE)) {
+		if (esp_sanity_checks(fastboot_download_file())) {
 			fastboot_fail("malformed bootloader image");
 			goto out;
 		}
@@ -871,15 +1011,20 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 
 	pr_debug("target '%s' volume size: %" PRIu64 " MiB\n", targetspec, vsize >> 20);
 
-	if (sz >= sizeof(magic))
-		memcpy(&magic, data, sizeof(magic));
+	head_len = data_window_read(dw, &magic, sizeof(magic), 0);
 
-	if (magic == SPARSE_HEADER_MAGIC) {
+	if (is_compressed_image(&magic, head_len)) {
+		/* Expanded size isn't known until we're done, the writer
+		 * refuses to go past the end of the partition */
+		pr_debug("Writing compressed image to %s\n", vol->blk_device);
+		ret = named_file_write_decompress(vol->blk_device, dw,
+				vsize, flags);
+	} else if (magic == SPARSE_HEADER_MAGIC &&
+			data_window_read(dw, &sh, sizeof(sh), 0) == sizeof(sh)) {
 		/* If there is enough data to hold the header,
 		 * and MAGIC appears in header,
 		 * then it is a sparse ext4 image */
-		struct sparse_header *sh = (struct sparse_header *)data;
-		uint64_t totalsize = (uint64_t)sh->blk_sz * (uint64_t)sh->total_blks;
+		uint64_t totalsize = (uint64_t)sh.blk_sz * (uint64_t)sh.total_blks;
 		pr_debug("Detected sparse header, total size %" PRIu64 " MiB\n",
 				totalsize >> 20);
 		if (totalsize > vsize) {
@@ -888,7 +1033,8 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 			fastboot_fail("target partition too small!");
 			goto out;
 		}
-		ret = named_file_write_ext4_sparse(vol->blk_device, FASTBOOT_DOWNLOAD_TMP_FILE);
+		ret = named_file_write_image(vol->blk_device, dw, vsize,
+				flags);
 	} else {
 		if (sz > vsize) {
 			pr_error("need %d, %" PRIu64 " available\n",
@@ -897,14 +1043,14 @@ static void cmd_flash(char *targetspec, int fd, void *data, unsigned sz)
 			goto out;
 		}
 		pr_debug("Writing %u MiB to %s\n", sz >> 20, vol->blk_device);
-		ret = named_file_write(vol->blk_device, data, sz, 0, 0);
+		ret = named_file_write_image(vol->blk_device, dw, vsize,
+				flags);
 	}
 	pr_verbose("Done writing image\n");
 	if (ret) {
 		fastboot_fail("Can't write data to target device");
 		goto out;
 	}
-	sync();
 
 	pr_debug("wrote %u bytes to %s\n", sz, vol->blk_device);
 
@@ -913,6 +1059,241 @@ out:
 	hashmapFree(tgt.params);
 }
 
+/* Set up the next download to be written straight to the named
+ * partition. Images which need sanity checks or plugin handling
+ * have to go through the regular staged path. */
+static int oem_stream_flash(int argc, char **argv)
+{
+	enum device_state current_state;
+	struct fstab_rec *vol;
+	uint64_t vsize;
+	char *name;
+
+	if (argc != 2) {
+		pr_error("usage: oem stream-flash <partition>\n");
+		return -1;
+	}
+	name = argv[1];
+
+	if (hashmapContainsKey(flash_cmds, name) ||
+			!strcmp(name, "fastboot") ||
+			!strcmp(name, "recovery") ||
+			!strcmp(name, "boot") ||
+			!strcmp(name, "bootloader")) {
+		pr_error("%s can't be streamed\n", name);
+		return -1;
+	}
+
+	current_state = get_device_state();
+	if (current_state == VERIFIED &&
+			!hashmapContainsKey(flash_whitelist, name)) {
+		pr_error("can't flash this partition in VERIFIED state\n");
+		return -1;
+	}
+
+	vol = volume_for_name(name);
+	if (!vol) {
+		pr_error("unknown partition %s\n", name);
+		return -1;
+	}
+
+	if (erase_queue_busy(name)) {
+		pr_error("%s is being erased in the background\n", name);
+		return -1;
+	}
+
+	if (!is_valid_blkdev(vol->blk_device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+
+	if (get_volume_size(vol, &vsize)) {
+		pr_error("couldn't get volume size\n");
+		return -1;
+	}
+
+	return flash_stream_arm(name, vol, vsize);
+}
+
+
+/* Start erasing the named partitions in the background and return
+ * right away. Each one reports through getvar erase-status:<name>. */
+static int oem_erase_async(int argc, char **argv)
+{
+	struct fstab_rec *vol;
+	const char *denied;
+	int i;
+
+	if (argc < 2) {
+		pr_error("usage: oem erase-async <partition> [<partition>...]\n");
+		return -1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		denied = erase_denied(argv[i]);
+		if (denied) {
+			pr_error("%s: %s\n", argv[i], denied);
+			return -1;
+		}
+
+		vol = volume_for_name(argv[i]);
+		if (!vol) {
+			pr_error("unknown partition %s\n", argv[i]);
+			return -1;
+		}
+
+		if (!is_valid_blkdev(vol->blk_device)) {
+			pr_error("invalid destination node. partition disks?\n");
+			return -1;
+		}
+
+		if (erase_queue_start(argv[i], vol))
+			return -1;
+	}
+	return 0;
+}
+
+
+/* Largest single "fetch" response. DATA lengths are 32 bits, the stock
+ * fastboot tool splits bigger reads up according to max-fetch-size. */
+#define FETCH_MAX_SIZE	0x80000000U
+#define FETCH_BLOCK_SIZE	4096
+#define BLOCKMAP_DEFAULT_SIZE	(64 * 1024)
+
+/* Open the named partition for reading back the given range. offstr and
+ * sizestr are optional hex numbers; by default the rest of the partition
+ * after offset is returned. */
+static int open_fetch_range(const char *name, const char *offstr,
+		const char *sizestr, uint64_t *offset, uint64_t *len)
+{
+	struct fstab_rec *vol;
+	uint64_t vsize;
+	char *end;
+	int fd;
+
+	/* Partitions hold user data, same rule as flashing arbitrary
+	 * targets */
+	if (get_device_state() != UNLOCKED) {
+		pr_error("bootloader must be unlocked to read partitions\n");
+		return -1;
+	}
+
+	vol = volume_for_name(name);
+	if (!vol) {
+		pr_error("unknown partition %s\n", name);
+		return -1;
+	}
+	if (!is_valid_blkdev(vol->blk_device)) {
+		pr_error("invalid source node. partition disks?\n");
+		return -1;
+	}
+	if (get_volume_size(vol, &vsize)) {
+		pr_error("couldn't get volume size\n");
+		return -1;
+	}
+
+	*offset = 0;
+	if (offstr && *offstr) {
+		*offset = strtoull(offstr, &end, 16);
+		if (*end || *offset > vsize) {
+			pr_error("bad offset '%s'\n", offstr);
+			return -1;
+		}
+	}
+	*len = vsize - *offset;
+	if (sizestr && *sizestr) {
+		*len = strtoull(sizestr, &end, 16);
+		if (*end || *len > vsize - *offset) {
+			pr_error("bad size '%s'\n", sizestr);
+			return -1;
+		}
+	}
+
+	fd = open(vol->blk_device, O_RDONLY);
+	if (fd < 0)
+		pr_perror("open");
+	return fd;
+}
+
+/* Stream a partition, or a range of it, back to the host.
+ * fetch:<name>[:<offset>[:<size>]], offset and size in hex as sent by
+ * "fastboot fetch". */
+static void cmd_fetch(char *arg, int fd, void *data, unsigned sz)
+{
+	char *name, *offstr, *sizestr, *saveptr;
+	uint64_t offset, len;
+	int pfd;
+
+	name = strtok_r(arg, ":", &saveptr);
+	offstr = strtok_r(NULL, ":", &saveptr);
+	sizestr = strtok_r(NULL, ":", &saveptr);
+	if (!name) {
+		fastboot_fail("missing partition name");
+		return;
+	}
+
+	pfd = open_fetch_range(name, offstr, sizestr, &offset, &len);
+	if (pfd < 0) {
+		fastboot_fail("can't read %s", name);
+		return;
+	}
+	if (len > FETCH_MAX_SIZE) {
+		fastboot_fail("larger than max-fetch-size");
+		goto out;
+	}
+
+	pr_status("Sending %" PRIu64 " bytes of %s\n", len, name);
+	if (!fastboot_send_data(pfd, offset, len))
+		fastboot_okay("");
+out:
+	close(pfd);
+}
+
+/* Read back a partition as a sparse image. Zero and other fill blocks
+ * collapse to a few bytes each, so mostly empty partitions come out
+ * small. The image is staged for "fastboot get_staged". */
+static int oem_fetch_sparse(int argc, char **argv)
+{
+	uint64_t offset, len;
+	int64_t size;
+	int pfd, ufd;
+	int ret = -1;
+
+	if (argc < 2 || argc > 4) {
+		pr_error("usage: oem fetch-sparse <partition> [<offset> [<size>]]\n");
+		return -1;
+	}
+
+	pfd = open_fetch_range(argv[1], argc > 2 ? argv[2] : NULL,
+			argc > 3 ? argv[3] : NULL, &offset, &len);
+	if (pfd < 0)
+		return -1;
+	if (offset % FETCH_BLOCK_SIZE || len % FETCH_BLOCK_SIZE) {
+		pr_error("range must be aligned to %d bytes\n", FETCH_BLOCK_SIZE);
+		goto out;
+	}
+
+	ufd = fastboot_stage_upload_begin();
+	if (ufd < 0)
+		goto out;
+
+	pr_status("Reading %s, this can take a while...\n", argv[1]);
+	mui_show_progress(1.0, 0);
+	size = sparse_encode(pfd, offset, len, FETCH_BLOCK_SIZE, ufd,
+			min((uint64_t)fastboot_staging_room(), (uint64_t)UINT_MAX));
+	mui_reset_progress();
+	if (fastboot_stage_upload_end(ufd, size >= 0))
+		goto out;
+
+	fastboot_info("%" PRId64 " byte sparse image staged, use", size);
+	fastboot_info("'fastboot get_staged <file>' to fetch it");
+	ret = 0;
+out:
+	close(pfd);
+	return ret;
+}
+
+
 static int parse_state_cmd(char *cmd, enum device_state *state)
 {
 	if (!strcmp(cmd, CMD_UNLOCK)) {
@@ -960,12 +1341,15 @@ static void cmd_oem(char *arg, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
-	/* Check if user sent one of various state transition commands */
+	/* "oem" itself is registered read-only, so take the action lock
+	 * here for everything but queries */
 	if (!parse_state_cmd(argv[0], &new_state)) {
+		pthread_mutex_lock(&action_mutex);
 		if (set_device_state(new_state))
 			fastboot_fail("couldn't change state");
 		else
 			fastboot_okay("");
+		pthread_mutex_unlock(&action_mutex);
 		goto out;
 	}
 
@@ -975,13 +1359,20 @@ static void cmd_oem(char *arg, int fd, void *data, unsigned sz)
 		goto out;
 	}
 
+	/* Checked under the lock, so the state can't change before the
+	 * command runs */
+	if (!cs->query)
+		pthread_mutex_lock(&action_mutex);
 	device_state = get_device_state();
 	if (device_state < cs->min_state) {
+		if (!cs->query)
+			pthread_mutex_unlock(&action_mutex);
 		fastboot_fail("command not allowed in this device state");
 		goto out;
 	}
-
 	ret = ((oem_func)cs->callback)(argc, argv);
+	if (!cs->query)
+		pthread_mutex_unlock(&action_mutex);
 	if (ret) {
 		pr_error("oem %s command failed, retval = %d\n",
 				argv[0], ret);
@@ -1362,6 +1753,16 @@ static int garbage_disk(int argc, char **argv)
 	int64_t remaining_disk, disk_size;
 	int ret = -1;
 
+	if (erase_queue_busy(NULL)) {
+		pr_error("wait for background erases to finish\n");
+		return -1;
+	}
+
+	if (flash_stream_pending(NULL)) {
+		pr_error("a streamed flash is pending\n");
+		return -1;
+	}
+
 	if (argc == 2)
 		disk_name = xstrdup(argv[1]);
 	else
@@ -1545,18 +1946,16 @@ static int oem_showtext(int argc, char **argv)
 }
 
 #ifndef USER
-#define MAX_INFO_LEN	59
 #define FALLBACK_KLOG_BUF_SHIFT	17	/* CONFIG_LOG_BUF_SHIFT from our kernel */
 #define FALLBACK_KLOG_BUF_LEN	(1 << FALLBACK_KLOG_BUF_SHIFT)
 
+/* The kernel log is staged for "fastboot get_staged" rather than
+ * trickled out in INFO messages */
 static int oem_dmesg(int argc, char **argv)
 {
-	char *buf, *str, *saveptr, *line;
-	char linebuf[MAX_INFO_LEN + 1];
+	char *buf;
 	int buf_sz, ret;
 
-	linebuf[MAX_INFO_LEN] = '\0';
-
 	/* Don't know why this fails, backup numbers taken from toolbox */
 	buf_sz = klogctl(KLOG_SIZE_BUFFER, 0, 0);
 	if (buf_sz < 0) {
@@ -1564,7 +1963,7 @@ static int oem_dmesg(int argc, char **argv)
 		buf_sz = FALLBACK_KLOG_BUF_LEN;
 	}
 
-	buf = xmalloc(buf_sz + 1);
+	buf = xmalloc(buf_sz);
 
 	ret = klogctl(KLOG_READ_ALL, buf, buf_sz);
 	if (ret < 0) {
@@ -1572,21 +1971,14 @@ static int oem_dmesg(int argc, char **argv)
 		free(buf);
 		return -1;
 	}
-	buf[ret] = '\0';
 
-	for (str = buf; ; str = NULL) {
-		line = strtok_r(str, "\n", &saveptr);
-		if (line == NULL)
-			break;
-
-		while (strlen(line) > MAX_INFO_LEN) {
-			strncpy(linebuf, line, MAX_INFO_LEN);
-			fastboot_info(linebuf);
-			line += MAX_INFO_LEN;
-		}
-		fastboot_info(line);
+	if (fastboot_stage_upload(buf, ret)) {
+		free(buf);
+		return -1;
 	}
 	free(buf);
+	fastboot_info("%d bytes of kernel log staged, use", ret);
+	fastboot_info("'fastboot get_staged <file>' to fetch it");
 	return 0;
 }
 #endif
@@ -1607,6 +1999,59 @@ static int oem_get_hashes(int argc, char **argv)
 }
 
 
+/* Per-block digest map of a partition, so the host can work out which
+ * blocks differ from the image it is about to send and only send those.
+ * The map is staged for "fastboot get_staged". */
+static int oem_get_blockmap(int argc, char **argv)
+{
+	uint64_t offset, len;
+	unsigned long bs = BLOCKMAP_DEFAULT_SIZE;
+	size_t map_len;
+	void *map = NULL;
+	char *end;
+	int pfd;
+	int ret = -1;
+
+	if (argc < 2 || argc > 3) {
+		pr_error("usage: oem get-blockmap <partition> [<block size>]\n");
+		return -1;
+	}
+	if (argc > 2) {
+		bs = strtoul(argv[2], &end, 0);
+		if (*end || bs < FETCH_BLOCK_SIZE || (bs & (bs - 1))) {
+			pr_error("bad block size '%s'\n", argv[2]);
+			return -1;
+		}
+	}
+
+	pfd = open_fetch_range(argv[1], NULL, NULL, &offset, &len);
+	if (pfd < 0)
+		return -1;
+
+	/* Refuse before spending minutes hashing */
+	map_len = block_map_size(len, bs);
+	if (map_len > fastboot_staging_room()) {
+		pr_error("block map too large, use a bigger block size\n");
+		goto out;
+	}
+
+	pr_status("Hashing %s...\n", argv[1]);
+	map = get_block_map(pfd, offset, len, bs, &map_len);
+	if (!map)
+		goto out;
+	if (fastboot_stage_upload(map, map_len))
+		goto out;
+
+	fastboot_info("%zu byte block map staged, use", map_len);
+	fastboot_info("'fastboot get_staged <file>' to fetch it");
+	ret = 0;
+out:
+	free(map);
+	close(pfd);
+	return ret;
+}
+
+
 #ifndef USER
 static int oem_clear_lock(int argc, char **argv)
 {
@@ -1745,7 +2190,7 @@ void aboot_register_commands(void)
 
 	provisioning = is_provisioning_mode();
 
-	fastboot_register("oem", cmd_oem);
+	fastboot_register_windowed("oem", cmd_oem, true);
 	fastboot_register("reboot", cmd_reboot);
 	fastboot_register("reboot-bootloader", cmd_reboot_bl);
 	fastboot_register("continue", cmd_reboot);
@@ -1798,8 +2243,11 @@ void aboot_register_commands(void)
 	fastboot_publish(OFF_MODE_CHARGE, get_off_mode_charge());
 
 	fastboot_register("boot", cmd_boot);
-	fastboot_register("erase:", cmd_erase);
-	fastboot_register("flash:", cmd_flash);
+	fastboot_register_windowed("erase:", cmd_erase, false);
+	fastboot_register_windowed("format:", cmd_format, false);
+	fastboot_register_windowed("flash:", cmd_flash, false);
+	fastboot_register_windowed("fetch:", cmd_fetch, false);
+	fastboot_publish("max-fetch-size", xasprintf("0x%X", FETCH_MAX_SIZE));
 
 	aboot_register_flash_cmd("gpt", cmd_flash_gpt, UNLOCKED);
 	aboot_register_flash_cmd("oemvars", cmd_flash_oemvars, UNLOCKED);
@@ -1814,14 +2262,18 @@ void aboot_register_commands(void)
 	aboot_register_oem_cmd("hidetext", oem_hidetext, LOCKED);
 	aboot_register_oem_cmd("off-mode-charge", oem_off_mode_charge, UNLOCKED);
 	aboot_register_oem_cmd("get-hashes", oem_get_hashes, LOCKED);
+	aboot_register_oem_cmd("get-blockmap", oem_get_blockmap, UNLOCKED);
 	aboot_register_oem_cmd("audiodebug", oem_audio_debug, UNLOCKED);
+	aboot_register_oem_cmd("stream-flash", oem_stream_flash, VERIFIED);
+	aboot_register_oem_cmd("erase-async", oem_erase_async, VERIFIED);
+	aboot_register_oem_cmd("fetch-sparse", oem_fetch_sparse, UNLOCKED);
 
 #ifndef USER
 	aboot_register_flash_cmd("mbr", cmd_flash_mbr, UNLOCKED);
 	aboot_register_flash_cmd("efirun", cmd_flash_efirun, UNLOCKED);
 
 	aboot_register_oem_cmd("reprovision", oem_clear_lock, LOCKED);
-	aboot_register_oem_cmd("dmesg", oem_dmesg, LOCKED);
+	aboot_register_oem_query("dmesg", oem_dmesg, LOCKED);
 #endif
 	register_userfastboot_plugins();
 
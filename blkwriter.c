@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <cutils/properties.h>
+
+#include "aio_syscalls.h"
+#include "blkwriter.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define BLK_DEPTH_PROP		"ro.userfastboot.blk_depth"
+#define BLK_BUF_SIZE_PROP	"ro.userfastboot.blk_buf_size"
+#define BLK_DEPTH		8
+#define BLK_BUF_SIZE		(1024 * 1024)
+
+/* Memory alignment for O_DIRECT buffers; offsets and lengths only need
+ * to match the logical block size */
+#define BLK_MEM_ALIGN		4096
+
+struct blkwriter {
+	int fd;
+	bool direct;
+	bool fell_back;	/* O_DIRECT was refused, writes already in flight
+			   may still come back with -EINVAL */
+	size_t align;
+
+	aio_context_t ctx;
+	bool aio;
+
+	unsigned depth;
+	size_t buf_size;
+	unsigned char *bufs;
+
+	/* Slots are used and retired in submission order, like the
+	 * requests of a usb_aio transfer */
+	struct iocb *iocbs;
+	struct io_event *events;
+	long long *res;
+	bool *done;
+	unsigned head;
+	unsigned inflight;
+
+	/* Slot being filled, always the one after the last in flight */
+	bool cur_open;
+	uint64_t cur_offset;
+	size_t cur_len;
+
+	uint64_t queued;
+	uint64_t retired;
+	void (*retire_cb)(void *ctx, uint64_t retired);
+	void *retire_ctx;
+
+	bool failed;
+};
+
+
+static unsigned char *slot_buf(struct blkwriter *bw, unsigned slot)
+{
+	return bw->bufs + (size_t)slot * bw->buf_size;
+}
+
+
+static void retire(struct blkwriter *bw, size_t len)
+{
+	bw->retired += len;
+	if (bw->retire_cb)
+		bw->retire_cb(bw->retire_ctx, bw->retired);
+}
+
+
+static int sync_pwrite(struct blkwriter *bw, const unsigned char *buf,
+		size_t len, uint64_t offset)
+{
+	while (len) {
+		ssize_t ret = pwrite64(bw->fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("pwrite64");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+
+static int go_buffered(struct blkwriter *bw)
+{
+	int flags = fcntl(bw->fd, F_GETFL);
+
+	pr_debug("blkwriter: O_DIRECT refused, using buffered writes\n");
+	if (flags < 0 || fcntl(bw->fd, F_SETFL, flags & ~O_DIRECT)) {
+		pr_perror("fcntl");
+		return -1;
+	}
+	bw->direct = false;
+	bw->fell_back = true;
+	return 0;
+}
+
+
+/* Synchronous path, for when AIO can't be used for this piece */
+static int write_slot_sync(struct blkwriter *bw, unsigned slot,
+		size_t len, uint64_t offset)
+{
+	const unsigned char *buf = slot_buf(bw, slot);
+
+	if (bw->direct && (offset % bw->align || len % bw->align)) {
+		/* Unaligned pieces go through the page cache. The kernel
+		 * writes back and invalidates around direct I/O, so the two
+		 * stay coherent. */
+		int ret, flags = fcntl(bw->fd, F_GETFL);
+
+		if (flags < 0 || fcntl(bw->fd, F_SETFL, flags & ~O_DIRECT)) {
+			pr_perror("fcntl");
+			return -1;
+		}
+		ret = sync_pwrite(bw, buf, len, offset);
+		if (!ret && fdatasync(bw->fd)) {
+			pr_perror("fdatasync");
+			ret = -1;
+		}
+		if (fcntl(bw->fd, F_SETFL, flags)) {
+			pr_perror("fcntl");
+			ret = -1;
+		}
+		return ret;
+	}
+
+	if (sync_pwrite(bw, buf, len, offset)) {
+		if (!bw->direct || errno != EINVAL || go_buffered(bw))
+			return -1;
+		return sync_pwrite(bw, buf, len, offset);
+	}
+	return 0;
+}
+
+
+/* Reap completions until at most max requests are in flight */
+static void reap(struct blkwriter *bw, unsigned max)
+{
+	while (bw->inflight > max) {
+		int i, r;
+
+		r = io_getevents(bw->ctx, 1, bw->depth, bw->events, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("io_getevents");
+			/* Nothing in flight can be trusted now */
+			io_destroy(bw->ctx);
+			bw->aio = false;
+			bw->inflight = 0;
+			bw->failed = true;
+			return;
+		}
+		for (i = 0; i < r; i++) {
+			unsigned slot = bw->events[i].data;
+
+			bw->res[slot] = bw->events[i].res;
+			bw->done[slot] = true;
+		}
+
+		while (bw->inflight && bw->done[bw->head]) {
+			struct iocb *cb = &bw->iocbs[bw->head];
+			long long res = bw->res[bw->head];
+
+			if (res == -EINVAL && (bw->direct || bw->fell_back)) {
+				/* Accepted by io_submit but not by the
+				 * device; redo it the slow way. The first
+				 * one switches the writer over, the rest
+				 * were submitted before it did. */
+				if ((bw->direct && go_buffered(bw)) ||
+						write_slot_sync(bw, bw->head,
+							cb->aio_nbytes,
+							cb->aio_offset))
+					bw->failed = true;
+				else
+					retire(bw, cb->aio_nbytes);
+			} else if (res < 0) {
+				pr_error("blkwriter: write at %llu failed: %s\n",
+						(unsigned long long)cb->aio_offset,
+						strerror(-res));
+				bw->failed = true;
+			} else if ((unsigned long long)res != cb->aio_nbytes) {
+				/* Block devices don't do short writes unless
+				 * we ran off the end */
+				pr_error("blkwriter: short write at %llu\n",
+						(unsigned long long)cb->aio_offset);
+				bw->failed = true;
+			} else {
+				retire(bw, res);
+			}
+			bw->head = (bw->head + 1) % bw->depth;
+			bw->inflight--;
+		}
+	}
+}
+
+
+static void submit_cur(struct blkwriter *bw)
+{
+	unsigned slot = (bw->head + bw->inflight) % bw->depth;
+	struct iocb *cb = &bw->iocbs[slot];
+	size_t len = bw->cur_len;
+	uint64_t offset = bw->cur_offset;
+
+	bw->cur_open = false;
+	bw->cur_len = 0;
+	if (bw->failed)
+		return;
+
+	if (!bw->aio || (bw->direct &&
+				(offset % bw->align || len % bw->align))) {
+		/* Keep the order of writes as queued */
+		reap(bw, 0);
+		if (write_slot_sync(bw, slot, len, offset))
+			bw->failed = true;
+		else
+			retire(bw, len);
+		return;
+	}
+
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_data = slot;
+	cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb->aio_fildes = bw->fd;
+	cb->aio_buf = (uintptr_t)slot_buf(bw, slot);
+	cb->aio_nbytes = len;
+	cb->aio_offset = offset;
+	bw->done[slot] = false;
+
+	while (io_submit(bw->ctx, 1, &cb) != 1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && bw->inflight) {
+			reap(bw, bw->inflight - 1);
+			continue;
+		}
+		if (errno == EAGAIN) {
+			/* Out of AIO resources with nothing of ours to
+			 * wait for, don't spin on it */
+			if (write_slot_sync(bw, slot, len, offset))
+				bw->failed = true;
+			else
+				retire(bw, len);
+			return;
+		}
+		pr_debug("io_submit: %s, writing synchronously\n",
+				strerror(errno));
+		reap(bw, 0);
+		bw->aio = false;
+		if (write_slot_sync(bw, slot, len, offset))
+			bw->failed = true;
+		else
+			retire(bw, len);
+		return;
+	}
+	bw->inflight++;
+}
+
+
+struct blkwriter *blkwriter_open(const char *filename)
+{
+	struct blkwriter *bw;
+	char val[PROPERTY_VALUE_MAX];
+	int ssz;
+
+	bw = xmalloc(sizeof(*bw));
+	memset(bw, 0, sizeof(*bw));
+
+	property_get(BLK_DEPTH_PROP, val, "");
+	bw->depth = val[0] ? strtoul(val, NULL, 0) : BLK_DEPTH;
+	property_get(BLK_BUF_SIZE_PROP, val, "");
+	bw->buf_size = val[0] ? strtoul(val, NULL, 0) : BLK_BUF_SIZE;
+	if (!bw->depth)
+		bw->depth = 1;
+	bw->buf_size = max(bw->buf_size - bw->buf_size % BLK_MEM_ALIGN,
+			(size_t)BLK_MEM_ALIGN);
+
+	bw->fd = open(filename, O_WRONLY | O_DIRECT);
+	bw->direct = bw->fd >= 0;
+	if (bw->fd < 0)
+		bw->fd = open(filename, O_WRONLY);
+	if (bw->fd < 0) {
+		pr_error("Couldn't open %s: %s\n", filename, strerror(errno));
+		free(bw);
+		return NULL;
+	}
+
+	/* Regular files (loop backing files, mostly) don't answer this;
+	 * the page size satisfies any of them */
+	if (ioctl(bw->fd, BLKSSZGET, &ssz) || ssz <= 0)
+		ssz = BLK_MEM_ALIGN;
+	bw->align = ssz;
+
+	if (posix_memalign((void **)&bw->bufs, BLK_MEM_ALIGN,
+				bw->depth * bw->buf_size))
+		die_errno("posix_memalign");
+	bw->iocbs = xmalloc(bw->depth * sizeof(*bw->iocbs));
+	bw->events = xmalloc(bw->depth * sizeof(*bw->events));
+	bw->res = xmalloc(bw->depth * sizeof(*bw->res));
+	bw->done = xmalloc(bw->depth * sizeof(*bw->done));
+
+	bw->aio = !io_setup(bw->depth, &bw->ctx);
+	if (!bw->aio)
+		pr_debug("io_setup: %s, writing synchronously\n",
+				strerror(errno));
+
+	pr_verbose("blkwriter: %s %s, %u x %zu bytes\n", filename,
+			bw->direct ? "direct" : "buffered", bw->depth,
+			bw->buf_size);
+	return bw;
+}
+
+
+int blkwriter_fd(struct blkwriter *bw)
+{
+	return bw->fd;
+}
+
+
+int blkwriter_write(struct blkwriter *bw, const void *data, size_t len,
+		uint64_t offset)
+{
+	const unsigned char *buf = data;
+
+	while (len && !bw->failed) {
+		size_t n;
+
+		if (bw->cur_open && offset != bw->cur_offset + bw->cur_len)
+			submit_cur(bw);
+
+		if (!bw->cur_open) {
+			/* Wait for the oldest slot to come back */
+			if (bw->aio)
+				reap(bw, bw->depth - 1);
+			bw->cur_open = true;
+			bw->cur_offset = offset;
+			bw->cur_len = 0;
+		}
+
+		n = min(len, bw->buf_size - bw->cur_len);
+		memcpy(slot_buf(bw, (bw->head + bw->inflight) % bw->depth) +
+				bw->cur_len, buf, n);
+		bw->cur_len += n;
+		bw->queued += n;
+		buf += n;
+		len -= n;
+		offset += n;
+
+		if (bw->cur_len == bw->buf_size)
+			submit_cur(bw);
+	}
+	return bw->failed ? -1 : 0;
+}
+
+
+uint64_t blkwriter_queued(struct blkwriter *bw)
+{
+	return bw->queued;
+}
+
+
+void blkwriter_set_retire_cb(struct blkwriter *bw,
+		void (*cb)(void *ctx, uint64_t retired), void *ctx)
+{
+	bw->retire_cb = cb;
+	bw->retire_ctx = ctx;
+}
+
+
+int blkwriter_flush(struct blkwriter *bw)
+{
+	if (bw->cur_open)
+		submit_cur(bw);
+	if (bw->aio)
+		reap(bw, 0);
+	return bw->failed ? -1 : 0;
+}
+
+
+int blkwriter_close(struct blkwriter *bw)
+{
+	int ret;
+
+	ret = blkwriter_flush(bw);
+	if (fsync(bw->fd)) {
+		pr_perror("fsync");
+		ret = -1;
+	}
+	close(bw->fd);
+
+	if (bw->aio)
+		io_destroy(bw->ctx);
+	free(bw->bufs);
+	free(bw->iocbs);
+	free(bw->events);
+	free(bw->res);
+	free(bw->done);
+	free(bw);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_BLKWRITER_H_
+#define _USERFASTBOOT_BLKWRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Writes to a block device with several requests in flight. Data is
+ * copied into aligned buffers and written with O_DIRECT through Linux
+ * AIO; contiguous writes are merged into full buffers first. Where
+ * O_DIRECT or AIO isn't available, or a piece isn't aligned to the
+ * device's block size, it falls back to plain synchronous writes.
+ *
+ * The queue depth and buffer size come from the properties
+ * ro.userfastboot.blk_depth and ro.userfastboot.blk_buf_size. */
+struct blkwriter;
+
+struct blkwriter *blkwriter_open(const char *filename);
+
+/* For ioctls on the device. Ranges passed to those must not overlap
+ * anything written but not yet flushed. */
+int blkwriter_fd(struct blkwriter *bw);
+
+/* Queue len bytes for offset. data can be reused once this returns.
+ * Errors are sticky: once a write failed, everything after fails. */
+int blkwriter_write(struct blkwriter *bw, const void *data, size_t len,
+		uint64_t offset);
+
+/* Bytes accepted by blkwriter_write() so far */
+uint64_t blkwriter_queued(struct blkwriter *bw);
+
+/* Have cb called whenever writes complete, with how many of the bytes
+ * queued so far are now on the device. Writes complete in the order
+ * they were queued. cb runs from within the blkwriter calls. */
+void blkwriter_set_retire_cb(struct blkwriter *bw,
+		void (*cb)(void *ctx, uint64_t retired), void *ctx);
+
+/* Wait until everything queued so far has been written */
+int blkwriter_flush(struct blkwriter *bw);
+
+/* Flush, fsync and free. Returns nonzero if anything failed along the
+ * way. */
+int blkwriter_close(struct blkwriter *bw);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
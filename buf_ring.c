@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buf_ring.h"
+#include "userfastboot_util.h"
+
+struct buf_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	unsigned count;
+	size_t size;
+	void **bufs;
+	size_t *lens;
+
+	/* Next buffer the producer fills and the consumer drains, and
+	 * how many are currently full */
+	unsigned head;
+	unsigned tail;
+	unsigned full;
+
+	bool closed;
+	bool aborted;
+};
+
+
+struct buf_ring *buf_ring_create(unsigned count, size_t size)
+{
+	struct buf_ring *r;
+	unsigned i;
+
+	r = xmalloc(sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->count = count;
+	r->size = size;
+	r->bufs = xmalloc(count * sizeof(*r->bufs));
+	r->lens = xmalloc(count * sizeof(*r->lens));
+	for (i = 0; i < count; i++)
+		r->bufs[i] = xmalloc(size);
+
+	buf_ring_reset(r);
+	return r;
+}
+
+
+void buf_ring_destroy(struct buf_ring *r)
+{
+	unsigned i;
+
+	if (!r)
+		return;
+
+	for (i = 0; i < r->count; i++)
+		free(r->bufs[i]);
+	free(r->bufs);
+	free(r->lens);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+
+void buf_ring_reset(struct buf_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->head = r->tail = r->full = 0;
+	r->closed = false;
+	r->aborted = false;
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+size_t buf_ring_buf_size(struct buf_ring *r)
+{
+	return r->size;
+}
+
+
+void *buf_ring_get_free(struct buf_ring *r)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->full == r->count && !r->aborted)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (!r->aborted)
+		buf = r->bufs[r->head];
+	pthread_mutex_unlock(&r->lock);
+	return buf;
+}
+
+
+void buf_ring_put_full(struct buf_ring *r, size_t len)
+{
+	pthread_mutex_lock(&r->lock);
+	r->lens[r->head] = len;
+	r->head = (r->head + 1) % r->count;
+	r->full++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+void buf_ring_close(struct buf_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+void *buf_ring_get_full(struct buf_ring *r, size_t *len)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->full && !r->closed && !r->aborted)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (r->full && !r->aborted) {
+		buf = r->bufs[r->tail];
+		*len = r->lens[r->tail];
+	}
+	pthread_mutex_unlock(&r->lock);
+	return buf;
+}
+
+
+void buf_ring_put_free(struct buf_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->tail = (r->tail + 1) % r->count;
+	r->full--;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+void buf_ring_abort(struct buf_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->aborted = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+bool buf_ring_aborted(struct buf_ring *r)
+{
+	bool ret;
+
+	pthread_mutex_lock(&r->lock);
+	ret = r->aborted;
+	pthread_mutex_unlock(&r->lock);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_BUF_RING_H_
+#define _USERFASTBOOT_BUF_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A fixed set of preallocated buffers passed between exactly one
+ * producer thread and one consumer thread. Buffers are handed out and
+ * returned in FIFO order, so data comes out in the order it went in.
+ * The producer blocks while every buffer is full, the consumer while
+ * all are empty. Either side can abort, which wakes up the other. */
+struct buf_ring;
+
+struct buf_ring *buf_ring_create(unsigned count, size_t size);
+void buf_ring_destroy(struct buf_ring *r);
+
+/* Make the ring ready for a new transfer. Both threads must be idle. */
+void buf_ring_reset(struct buf_ring *r);
+size_t buf_ring_buf_size(struct buf_ring *r);
+
+/* Producer side. get_free returns NULL if the ring was aborted. */
+void *buf_ring_get_free(struct buf_ring *r);
+void buf_ring_put_full(struct buf_ring *r, size_t len);
+/* No more data will be produced */
+void buf_ring_close(struct buf_ring *r);
+
+/* Consumer side. get_full returns NULL once the ring is closed and
+ * drained, or if it was aborted. */
+void *buf_ring_get_full(struct buf_ring *r, size_t *len);
+void buf_ring_put_free(struct buf_ring *r);
+
+void buf_ring_abort(struct buf_ring *r);
+bool buf_ring_aborted(struct buf_ring *r);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
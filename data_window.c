@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "data_window.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+void data_window_init(struct data_window *dw, int fd, uint64_t size)
+{
+	memset(dw, 0, sizeof(*dw));
+	dw->fd = fd;
+	dw->size = size;
+}
+
+
+const void *data_window_map(struct data_window *dw, uint64_t offset,
+		size_t len)
+{
+	uint64_t start;
+	size_t map_len;
+	void *map;
+
+	if (offset > dw->size || len > dw->size - offset)
+		return NULL;
+
+	if (dw->map && offset >= dw->map_offset &&
+			offset + len <= dw->map_offset + dw->map_len)
+		return dw->map + (offset - dw->map_offset);
+
+	data_window_release(dw);
+
+	/* Map a whole window even for small reads, the next one is
+	 * likely to follow right after */
+	start = offset - offset % DATA_WINDOW_ALIGN;
+	map_len = max(len + (size_t)(offset - start),
+			(size_t)DATA_WINDOW_SIZE);
+	map_len = min((uint64_t)map_len, dw->size - start);
+	if (!map_len) {
+		/* Empty range at the end of the file */
+		static const unsigned char empty;
+		return &empty;
+	}
+
+	map = mmap64(NULL, map_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+			dw->fd, start);
+	if (map == MAP_FAILED) {
+		pr_error("can't map %zu bytes at %" PRIu64 ": %s\n", map_len,
+				start, strerror(errno));
+		return NULL;
+	}
+	dw->map = map;
+	dw->map_offset = start;
+	dw->map_len = map_len;
+	return dw->map + (offset - start);
+}
+
+
+const void *data_window_next(struct data_window *dw, uint64_t offset,
+		size_t *len)
+{
+	if (offset >= dw->size)
+		return NULL;
+	*len = min(dw->size - offset, (uint64_t)DATA_WINDOW_SIZE);
+	return data_window_map(dw, offset, *len);
+}
+
+
+size_t data_window_read(struct data_window *dw, void *buf, size_t len,
+		uint64_t offset)
+{
+	const void *p;
+
+	if (offset >= dw->size)
+		return 0;
+	len = min((uint64_t)len, dw->size - offset);
+	p = data_window_map(dw, offset, len);
+	if (!p)
+		return 0;
+	memcpy(buf, p, len);
+	return len;
+}
+
+
+void data_window_release(struct data_window *dw)
+{
+	if (dw->map && munmap(dw->map, dw->map_len))
+		pr_perror("munmap");
+	dw->map = NULL;
+	dw->map_len = 0;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USERFASTBOOT_DATA_WINDOW_H_
+#define _USERFASTBOOT_DATA_WINDOW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Read access to a file that may be too big to map in one piece, such
+ * as a staged download on a 32 bit build. Only a window of the file is
+ * mapped at a time, and asking for a range outside it moves the window.
+ * Pointers handed out stay valid until the next call on the same
+ * data_window. */
+#define DATA_WINDOW_SIZE	(32 * 1024 * 1024)
+
+/* Windows start on a huge page boundary, so a file backed by huge pages
+ * can be mapped with them */
+#define DATA_WINDOW_ALIGN	(2 * 1024 * 1024)
+
+struct data_window {
+	int fd;
+	uint64_t size;
+
+	unsigned char *map;
+	uint64_t map_offset;
+	size_t map_len;
+};
+
+void data_window_init(struct data_window *dw, int fd, uint64_t size);
+
+/* Map len bytes at offset. NULL if the range is past the end of the
+ * file or can't be mapped. */
+const void *data_window_map(struct data_window *dw, uint64_t offset,
+		size_t len);
+
+/* For consuming the file front to back: map as much as a window holds
+ * starting at offset, at most DATA_WINDOW_SIZE, and return how much in
+ * *len. NULL at the end of the file or on error. */
+const void *data_window_next(struct data_window *dw, uint64_t offset,
+		size_t *len);
+
+/* Copy up to len bytes at offset, returns how many were copied */
+size_t data_window_read(struct data_window *dw, void *buf, size_t len,
+		uint64_t offset);
+
+/* Unmap the window; dw can be used again afterwards */
+void data_window_release(struct data_window *dw);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "buf_ring.h"
+#include "decompress.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define GZIP_MAGIC_0	0x1f
+#define GZIP_MAGIC_1	0x8b
+
+/* Output buffers between the inflate thread and the writer */
+#define INFLATE_BUF_SIZE	(4 * 1024 * 1024)
+#define INFLATE_BUF_COUNT	4
+
+struct inflater {
+	struct buf_ring *ring;
+	struct data_window *dw;
+	uint64_t consumed;
+	bool failed;
+};
+
+static bool is_gzip(const unsigned char *data, size_t len)
+{
+	return len >= 2 && data[0] == GZIP_MAGIC_0 && data[1] == GZIP_MAGIC_1;
+}
+
+bool is_compressed_image(const void *data, size_t len)
+{
+	return is_gzip(data, len);
+}
+
+
+/* Input is mapped a window at a time. zlib is done with the previous
+ * window whenever it asks for more. */
+static int inflate_refill(struct inflater *inf, z_stream *z)
+{
+	size_t n = 0;
+	const void *p;
+
+	p = data_window_next(inf->dw, inf->consumed, &n);
+	if (!p && inf->consumed < inf->dw->size)
+		return -1;
+	z->next_in = (unsigned char *)p;
+	z->avail_in = n;
+	inf->consumed += n;
+	return 0;
+}
+
+
+/* A gzip member can start right at the end of a window */
+static bool next_is_gzip(struct inflater *inf, z_stream *z)
+{
+	unsigned char magic[2];
+
+	if (z->avail_in >= sizeof(magic))
+		return is_gzip(z->next_in, z->avail_in);
+	return pread64(inf->dw->fd, magic, sizeof(magic),
+			inf->consumed - z->avail_in) == sizeof(magic) &&
+		is_gzip(magic, sizeof(magic));
+}
+
+
+static void *inflate_thread(void *arg)
+{
+	struct inflater *inf = arg;
+	size_t bufsize = buf_ring_buf_size(inf->ring);
+	unsigned char *buf;
+	z_stream z;
+	int ret = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	/* 32 enables gzip header detection */
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		pr_error("inflateInit2 failed\n");
+		goto fail;
+	}
+
+	while (ret != Z_STREAM_END) {
+		buf = buf_ring_get_free(inf->ring);
+		if (!buf)
+			break;
+
+		z.next_out = buf;
+		z.avail_out = bufsize;
+		while (z.avail_out) {
+			if (!z.avail_in && inflate_refill(inf, &z))
+				goto fail_zlib;
+
+			ret = inflate(&z, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				/* Concatenated gzip members are still one
+				 * image, as with gunzip */
+				if (!z.avail_in && inflate_refill(inf, &z))
+					goto fail_zlib;
+				if (!next_is_gzip(inf, &z))
+					break;
+				inflateReset(&z);
+				ret = Z_OK;
+			} else if (ret == Z_BUF_ERROR && !z.avail_in) {
+				pr_error("compressed image is truncated\n");
+				goto fail_zlib;
+			} else if (ret != Z_OK) {
+				pr_error("inflate: %s\n", z.msg ? z.msg : "error");
+				goto fail_zlib;
+			}
+		}
+		buf_ring_put_full(inf->ring, bufsize - z.avail_out);
+		mui_set_progress((float)(inf->consumed - z.avail_in) /
+				(float)inf->dw->size);
+	}
+
+	if (ret == Z_STREAM_END && z.avail_in)
+		pr_debug("ignoring data after the end of the compressed image\n");
+	inflateEnd(&z);
+	buf_ring_close(inf->ring);
+	return NULL;
+
+fail_zlib:
+	inflateEnd(&z);
+fail:
+	inf->failed = true;
+	buf_ring_abort(inf->ring);
+	return NULL;
+}
+
+
+int decompress_image(struct data_window *dw,
+		int (*write)(void *ctx, const void *buf, size_t len), void *ctx)
+{
+	struct inflater inf;
+	pthread_t thread;
+	void *buf;
+	size_t n;
+	int ret = 0;
+
+	inf.ring = buf_ring_create(INFLATE_BUF_COUNT, INFLATE_BUF_SIZE);
+	inf.dw = dw;
+	inf.consumed = 0;
+	inf.failed = false;
+
+	if (pthread_create(&thread, NULL, inflate_thread, &inf)) {
+		pr_error("couldn't create inflate thread\n");
+		buf_ring_destroy(inf.ring);
+		return -1;
+	}
+
+	mui_show_progress(1.0, 0);
+	while ((buf = buf_ring_get_full(inf.ring, &n))) {
+		if (write(ctx, buf, n)) {
+			ret = -1;
+			buf_ring_abort(inf.ring);
+			break;
+		}
+		buf_ring_put_free(inf.ring);
+	}
+	pthread_join(thread, NULL);
+	mui_reset_progress();
+
+	if (inf.failed)
+		ret = -1;
+	buf_ring_destroy(inf.ring);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_DECOMPRESS_H_
+#define _USERFASTBOOT_DECOMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "data_window.h"
+
+/* True if data starts like a compressed stream we can expand. Only
+ * gzip for now, that's what we have a library for. */
+bool is_compressed_image(const void *data, size_t len);
+
+/* Expand the contents of dw, handing the output to write() in order on
+ * the calling thread. Inflating runs on a thread of its own, so it
+ * overlaps with whatever write() does; that thread owns dw until this
+ * returns. write() returning nonzero stops everything. Returns 0 once
+ * all of the input was expanded and written. */
+int decompress_image(struct data_window *dw,
+		int (*write)(void *ctx, const void *buf, size_t len), void *ctx);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
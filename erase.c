@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#include "blkwriter.h"
+#include "erase.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define ERASE_SECDISCARD	(1 << 0)
+#define ERASE_DISCARD		(1 << 1)
+#define ERASE_ZEROOUT		(1 << 2)
+#define ERASE_ZERORANGE		(1 << 3)
+
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+/* Each discard ioctl has a long setup and teardown, so they are kept
+ * big; this only bounds how long the progress bar stands still */
+#define ERASE_MAX_CHUNK		(5ULL * 1024 * 1024 * 1024)
+
+/* Zeroing goes in smaller pieces, it takes about as long either way */
+#define ZERO_CHUNK		(256ULL * 1024 * 1024)
+
+/* What ERASE_POLICY_HEADERS zeroes at either end */
+#define ERASE_HEADER_SIZE	(1024ULL * 1024)
+
+/* Source for writing zeroes; blkwriter queues several of these at a
+ * time with O_DIRECT */
+#define ZEROES_ARRAY_SZ		(1024U * 1024)
+
+struct erase_caps {
+	dev_t dev;
+	unsigned methods;		/* ERASE_* still believed to work */
+	uint64_t discard_max;		/* 0 if there is no limit */
+	uint64_t granularity;
+	uint64_t alignment;		/* of granules, from the device start */
+	uint64_t write_zeroes_max;	/* 0 if zeroing isn't offloaded */
+	struct erase_caps *next;
+};
+
+static struct erase_caps *caps_list;
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* One erase_range() call */
+struct erase_job {
+	int fd;
+	struct erase_caps *caps;
+	unsigned allowed;	/* ERASE_* the policy permits */
+	uint64_t start, len;
+	struct blkwriter *bw;	/* opened if zeroes have to be written */
+	void (*progress)(void *ctx, uint64_t done);
+	void *ctx;
+};
+
+/* Cheap enough to call for every buffer, the UI only stores it */
+static void erase_progress(struct erase_job *job, uint64_t pos)
+{
+	if (job->progress)
+		job->progress(job->ctx, pos - job->start);
+	else
+		mui_set_progress((float)(pos - job->start) / (float)job->len);
+}
+
+static bool sysfs_exists(const char *path, const char *name)
+{
+	char *file = xasprintf("%s/%s", path, name);
+	bool ret = !access(file, F_OK);
+
+	free(file);
+	return ret;
+}
+
+static void erase_caps_probe(struct erase_caps *caps)
+{
+	char *dir, *queue;
+	int64_t val;
+
+	dir = xasprintf("/sys/dev/block/%u:%u", major(caps->dev),
+			minor(caps->dev));
+	/* Partitions share their disk's queue */
+	queue = xasprintf("%s/%squeue", dir,
+			sysfs_exists(dir, "partition") ? "../" : "");
+
+	caps->methods = ERASE_ZEROOUT | ERASE_ZERORANGE;
+	caps->granularity = 512;
+	if (!read_sysfs_int64(&val, "%s/discard_max_bytes", queue) && val > 0) {
+		caps->methods |= ERASE_SECDISCARD | ERASE_DISCARD;
+		caps->discard_max = val;
+	}
+	if (!read_sysfs_int64(&val, "%s/discard_granularity", queue) && val > 0)
+		caps->granularity = val;
+	if (sysfs_exists(dir, "discard_alignment") &&
+			!read_sysfs_int64(&val, "%s/discard_alignment", dir) &&
+			val > 0)
+		caps->alignment = val % caps->granularity;
+	if (sysfs_exists(queue, "write_zeroes_max_bytes") &&
+			!read_sysfs_int64(&val, "%s/write_zeroes_max_bytes",
+				queue) && val > 0)
+		caps->write_zeroes_max = val;
+
+	pr_debug("%u:%u erase: %s, discard max %" PRIu64 " granularity %"
+			PRIu64 " alignment %" PRIu64 ", write zeroes max %"
+			PRIu64 "\n", major(caps->dev), minor(caps->dev),
+			caps->methods & ERASE_DISCARD ? "discard" : "zero",
+			caps->discard_max, caps->granularity, caps->alignment,
+			caps->write_zeroes_max);
+	free(queue);
+	free(dir);
+}
+
+static struct erase_caps *erase_caps_get(int fd)
+{
+	struct erase_caps *caps;
+	struct stat sb;
+
+	if (fstat(fd, &sb)) {
+		pr_perror("fstat");
+		return NULL;
+	}
+	if (!S_ISBLK(sb.st_mode)) {
+		pr_error("can only erase block devices\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&caps_lock);
+	for (caps = caps_list; caps; caps = caps->next)
+		if (caps->dev == sb.st_rdev)
+			break;
+	if (!caps) {
+		caps = xmalloc(sizeof(*caps));
+		memset(caps, 0, sizeof(*caps));
+		caps->dev = sb.st_rdev;
+		erase_caps_probe(caps);
+		caps->next = caps_list;
+		caps_list = caps;
+	}
+	pthread_mutex_unlock(&caps_lock);
+	return caps;
+}
+
+static bool caps_has(struct erase_caps *caps, unsigned method)
+{
+	bool ret;
+
+	pthread_mutex_lock(&caps_lock);
+	ret = caps->methods & method;
+	pthread_mutex_unlock(&caps_lock);
+	return ret;
+}
+
+/* Whether a method is allowed for this erase and the device takes it */
+static bool job_can(struct erase_job *job, unsigned method)
+{
+	return caps_has(job->caps, method & job->allowed);
+}
+
+static void caps_drop(struct erase_caps *caps, unsigned method)
+{
+	pthread_mutex_lock(&caps_lock);
+	caps->methods &= ~method;
+	pthread_mutex_unlock(&caps_lock);
+}
+
+static int write_zeroes(struct erase_job *job, uint64_t start, uint64_t len)
+{
+	static char zeroes[ZEROES_ARRAY_SZ];
+
+	if (!job->bw) {
+		char *path = xasprintf("/proc/self/fd/%d", job->fd);
+
+		job->bw = blkwriter_open(path);
+		free(path);
+		if (!job->bw)
+			return -1;
+	}
+
+	while (len) {
+		size_t piece = min(len, (uint64_t)ZEROES_ARRAY_SZ);
+
+		if (blkwriter_write(job->bw, zeroes, piece, start))
+			return -1;
+		erase_progress(job, start);
+		start += piece;
+		len -= piece;
+	}
+	return 0;
+}
+
+static int zero_chunk(struct erase_job *job, uint64_t start, uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+
+	if (job_can(job, ERASE_ZEROOUT)) {
+		if (!ioctl(job->fd, BLKZEROOUT, &range))
+			return 0;
+		pr_info("BLKZEROOUT didn't work, trying to zero the range (%d:%s)\n",
+				errno, strerror(errno));
+		caps_drop(job->caps, ERASE_ZEROOUT);
+	}
+	if (job_can(job, ERASE_ZERORANGE)) {
+		if (!fallocate64(job->fd, FALLOC_FL_ZERO_RANGE, start, len))
+			return 0;
+		pr_info("Zeroing the range didn't work, writing zeroes (%d:%s)\n",
+				errno, strerror(errno));
+		pr_info("This can take a LONG time!\n");
+		caps_drop(job->caps, ERASE_ZERORANGE);
+	}
+	return write_zeroes(job, start, len);
+}
+
+static int discard_chunk(struct erase_job *job, uint64_t start, uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+
+	if (job_can(job, ERASE_SECDISCARD)) {
+		if (!ioctl(job->fd, BLKSECDISCARD, &range))
+			return 0;
+		pr_info("BLKSECDISCARD didn't work, trying BLKDISCARD (%d:%s)\n",
+				errno, strerror(errno));
+		caps_drop(job->caps, ERASE_SECDISCARD);
+	}
+	if (job_can(job, ERASE_DISCARD)) {
+		if (!ioctl(job->fd, BLKDISCARD, &range))
+			return 0;
+		pr_info("BLKDISCARD didn't work, fall back to zeroing out (%d:%s)\n",
+				errno, strerror(errno));
+		caps_drop(job->caps, ERASE_DISCARD);
+	}
+	return zero_chunk(job, start, len);
+}
+
+/* Erase one range for a job, discarding what the policy and device
+ * allow and zeroing the rest */
+static int erase_span(struct erase_job *job, uint64_t start, uint64_t len)
+{
+	struct erase_caps *caps = job->caps;
+	uint64_t end = start + len;
+	uint64_t dstart, dend, dchunk, zchunk, pos, piece;
+	int ret = 0;
+
+	/* Only whole granules can be discarded, anything around them gets
+	 * zeroed. Granules start at alignment. */
+	dstart = start + caps->alignment + caps->granularity - 1;
+	dstart -= dstart % caps->granularity + caps->alignment;
+	dend = end + caps->alignment;
+	dend = dend < caps->granularity ? 0 :
+		dend - dend % caps->granularity - caps->alignment;
+	if (!job_can(job, ERASE_SECDISCARD | ERASE_DISCARD) || dend <= dstart)
+		dstart = dend = end;
+
+	dchunk = ERASE_MAX_CHUNK;
+	if (caps->discard_max)
+		dchunk = min(dchunk, caps->discard_max);
+	if (dchunk > caps->granularity)
+		dchunk -= dchunk % caps->granularity;
+	zchunk = ZERO_CHUNK;
+	if (caps->write_zeroes_max)
+		zchunk = min(zchunk, caps->write_zeroes_max);
+
+	pr_debug("erasing offset %" PRIu64 " len %" PRIu64 ", discarding %"
+			PRIu64 "-%" PRIu64 "\n", start, len, dstart, dend);
+	for (pos = start; pos < end && !ret; pos += piece) {
+		erase_progress(job, pos);
+		if (pos >= dstart && pos < dend) {
+			piece = min(dend - pos, dchunk);
+			ret = discard_chunk(job, pos, piece);
+		} else {
+			piece = min((pos < dstart ? dstart : end) - pos, zchunk);
+			ret = zero_chunk(job, pos, piece);
+		}
+	}
+	return ret;
+}
+
+int erase_range(int fd, uint64_t start, uint64_t len,
+		enum erase_policy policy,
+		void (*progress)(void *ctx, uint64_t done), void *ctx)
+{
+	struct erase_job job;
+	int ret;
+
+	job.caps = erase_caps_get(fd);
+	if (!job.caps)
+		return -1;
+	job.fd = fd;
+	job.start = start;
+	job.len = len;
+	job.bw = NULL;
+	job.progress = progress;
+	job.ctx = ctx;
+
+	switch (policy) {
+	case ERASE_POLICY_SECURE:
+		job.allowed = ERASE_SECDISCARD | ERASE_DISCARD |
+			ERASE_ZEROOUT | ERASE_ZERORANGE;
+		break;
+	case ERASE_POLICY_DISCARD:
+		job.allowed = ERASE_DISCARD | ERASE_ZEROOUT | ERASE_ZERORANGE;
+		break;
+	default:
+		/* Discarded blocks aren't guaranteed to read back as zeroes */
+		job.allowed = ERASE_ZEROOUT | ERASE_ZERORANGE;
+		break;
+	}
+
+	if (policy == ERASE_POLICY_HEADERS && len > 2 * ERASE_HEADER_SIZE) {
+		ret = erase_span(&job, start, ERASE_HEADER_SIZE);
+		if (!ret)
+			ret = erase_span(&job, start + len - ERASE_HEADER_SIZE,
+					ERASE_HEADER_SIZE);
+	} else {
+		ret = erase_span(&job, start, len);
+	}
+
+	/* Written zeroes are only done once they're on the device */
+	if (job.bw && blkwriter_close(job.bw))
+		ret = -1;
+	if (!ret)
+		erase_progress(&job, start + len);
+	return ret ? -1 : 0;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
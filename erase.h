@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_ERASE_H_
+#define _USERFASTBOOT_ERASE_H_
+
+#include <stdint.h>
+
+/* How thoroughly to erase, set per partition with erase= in the fstab */
+enum erase_policy {
+	ERASE_POLICY_SECURE,	/* secure discard where the device can */
+	ERASE_POLICY_DISCARD,	/* plain discard, for data that isn't secret */
+	ERASE_POLICY_HEADERS,	/* zero just the ends, where filesystems and
+				   crypto footers keep their metadata */
+	ERASE_POLICY_ZERO,	/* zero everything, never discard */
+};
+
+/* Erase len bytes at start of the block device open as fd.
+ *
+ * What each device supports is probed the first time it is erased and
+ * remembered by device number: BLKSECDISCARD, then BLKDISCARD, then
+ * BLKZEROOUT, then fallocate(FALLOC_FL_ZERO_RANGE), then writing zeroes
+ * through a blkwriter. A method that fails is dropped for that device
+ * only. The policy can rule out some of these. Discards only cover
+ * whole discard granules, so unaligned ends of the range are zeroed
+ * instead, and big ranges go out in pieces no bigger than the device
+ * takes at once.
+ *
+ * Progress within the range goes to progress, as bytes done, or to the
+ * progress bar with mui_set_progress() if that is NULL. */
+int erase_range(int fd, uint64_t start, uint64_t len,
+		enum erase_policy policy,
+		void (*progress)(void *ctx, uint64_t done), void *ctx);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
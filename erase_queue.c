@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "erase.h"
+#include "erase_queue.h"
+#include "fastboot.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+struct bg_erase {
+	char *name;
+	char *device;
+	uint64_t size;
+	enum erase_policy policy;
+	unsigned percent;	/* last published */
+	struct bg_erase *next;
+};
+
+/* Erases still running, protected by erase_lock */
+static struct bg_erase *erases;
+static pthread_mutex_t erase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void publish_status(struct bg_erase *e, char *status)
+{
+	char *var = xasprintf("erase-status:%s", e->name);
+
+	fastboot_publish(var, status);
+	free(var);
+}
+
+static void erase_progress(void *ctx, uint64_t done)
+{
+	struct bg_erase *e = ctx;
+	unsigned percent = e->size ? done * 100 / e->size : 100;
+
+	/* Only publish when it reads differently */
+	if (percent == e->percent)
+		return;
+	e->percent = percent;
+	publish_status(e, xasprintf("erasing %u%%", percent));
+}
+
+
+static void *erase_thread(void *arg)
+{
+	struct bg_erase *e = arg;
+	struct bg_erase **pe;
+	int fd;
+	int ret = -1;
+
+	fd = open(e->device, O_RDWR);
+	if (fd < 0) {
+		pr_error("couldn't open block device %s\n", e->device);
+	} else {
+		ret = erase_range(fd, 0, e->size, e->policy,
+				erase_progress, e);
+		if (fsync(fd))
+			ret = -1;
+		close(fd);
+	}
+
+	if (ret)
+		pr_error("Background erase of %s failed\n", e->name);
+	else
+		pr_info("Background erase of %s done\n", e->name);
+	publish_status(e, xstrdup(ret ? "failed" : "done"));
+
+	pthread_mutex_lock(&erase_lock);
+	for (pe = &erases; *pe != e; pe = &(*pe)->next)
+		;
+	*pe = e->next;
+	pthread_mutex_unlock(&erase_lock);
+
+	free(e->name);
+	free(e->device);
+	free(e);
+	return NULL;
+}
+
+
+int erase_queue_start(const char *name, struct fstab_rec *vol)
+{
+	struct bg_erase *e;
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint64_t size;
+	int ret;
+
+	if (get_volume_size(vol, &size)) {
+		pr_error("couldn't get size of %s\n", name);
+		return -1;
+	}
+
+	pthread_mutex_lock(&erase_lock);
+	for (e = erases; e; e = e->next)
+		if (!strcmp(e->name, name))
+			break;
+	if (e) {
+		pthread_mutex_unlock(&erase_lock);
+		pr_error("%s is already being erased\n", name);
+		return -1;
+	}
+
+	e = xmalloc(sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->name = xstrdup(name);
+	e->device = xstrdup(vol->blk_device);
+	e->size = size;
+	e->policy = volume_erase_policy(vol);
+	publish_status(e, xstrdup("erasing 0%"));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, erase_thread, e);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		pthread_mutex_unlock(&erase_lock);
+		pr_error("couldn't start erase thread: %s\n", strerror(ret));
+		publish_status(e, xstrdup("failed"));
+		free(e->name);
+		free(e->device);
+		free(e);
+		return -1;
+	}
+	e->next = erases;
+	erases = e;
+	pthread_mutex_unlock(&erase_lock);
+
+	pr_status("Erasing %s in the background\n", name);
+	return 0;
+}
+
+
+bool erase_queue_busy(const char *name)
+{
+	struct bg_erase *e;
+
+	pthread_mutex_lock(&erase_lock);
+	for (e = erases; e; e = e->next)
+		if (!name || !strcmp(e->name, name))
+			break;
+	pthread_mutex_unlock(&erase_lock);
+	return e != NULL;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USERFASTBOOT_ERASE_QUEUE_H_
+#define _USERFASTBOOT_ERASE_QUEUE_H_
+
+#include <stdbool.h>
+
+#include "userfastboot_fstab.h"
+
+/* Erase the named partition on a thread of its own and return right
+ * away. Progress is published as erase-status:<name>, which reads
+ * "erasing <n>%" and ends up as "done" or "failed". Erases of different
+ * partitions run concurrently. */
+int erase_queue_start(const char *name, struct fstab_rec *vol);
+
+/* Whether the named partition is still being erased in the background.
+ * With name NULL, whether any partition is. */
+bool erase_queue_busy(const char *name);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
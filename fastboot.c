@@ -28,6 +28,7 @@
 #define LOG_TAG "fastboot"
 
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -37,19 +38,31 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <endian.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include <cutils/hashmap.h>
+#include <cutils/properties.h>
+#include <openssl/sha.h>
+#include <zlib.h>
 
 #include "userfastboot.h"
 #include "userfastboot_ui.h"
 #include "fastboot.h"
 #include "userfastboot_util.h"
+#include "buf_ring.h"
+#include "usb_aio.h"
+#include "udp.h"
+#include "data_window.h"
 
 
 #define USB_ADB_PATH      "/dev/android_adb"
@@ -66,6 +79,15 @@
 #define MAGIC_LENGTH 64
 #define XFER_MEM_SIZE 4096*1024
 
+/* FunctionFS AIO defaults, overridable with these properties. A depth
+ * of 0 selects plain synchronous reads and writes. */
+#define USB_AIO_DEPTH_PROP	"ro.userfastboot.usb_aio_depth"
+#define USB_AIO_SIZE_PROP	"ro.userfastboot.usb_aio_size"
+#define USB_AIO_DEPTH		16
+#define USB_AIO_SIZE		(1024 * 1024)
+#define USB_AIO_MAX_DEPTH	64
+#define USB_AIO_MAX_SIZE	(4 * 1024 * 1024)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
@@ -77,74 +99,127 @@ struct io_fds
 {
 	int read_fp;
 	int write_fp;
+	bool ffs;
+	struct usb_aio *aio;
+
+	/* fastboot-over-TCP: every transfer is wrapped in packets with an
+	 * 8 byte big-endian length header */
+	bool tcp;
+	uint64_t tcp_remaining;	/* payload bytes left in current packet */
+
+	/* fastboot-over-UDP, the session state lives in udp.c */
+	bool udp;
 };
-static struct io_fds io;
 
+#define TCP_PORT		5554
+#define TCP_HANDSHAKE		"FB01"
+#define TCP_HANDSHAKE_LEN	4
+#define TCP_SOCK_BUF		(4 * 1024 * 1024)
+
+static unsigned usb_aio_depth;
+static size_t usb_aio_size;
+static struct usb_aio *ffs_aio;
+
+/* Bursts of up to 16 packets (bMaxBurst is zero based) */
+#define MAX_BURST_SS		15
+
+#define FASTBOOT_INTF_DESC {						\
+	.bLength = USB_DT_INTERFACE_SIZE,				\
+	.bDescriptorType = USB_DT_INTERFACE,				\
+	.bInterfaceNumber = 0,						\
+	.bNumEndpoints = 2,						\
+	.bInterfaceClass = ADB_CLASS,					\
+	.bInterfaceSubClass = ADB_SUBCLASS,				\
+	.bInterfaceProtocol = FASTBOOT_PROTOCOL,			\
+	.iInterface = 1, /* first string from the provided table */	\
+}
+
+#define FASTBOOT_EP_DESC(addr, size) {					\
+	.bLength = USB_DT_ENDPOINT_SIZE,				\
+	.bDescriptorType = USB_DT_ENDPOINT,				\
+	.bEndpointAddress = (addr),					\
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,				\
+	.wMaxPacketSize = cpu_to_le16(size),				\
+}
+
+#define FASTBOOT_SS_COMP_DESC {						\
+	.bLength = USB_DT_SS_EP_COMP_SIZE,				\
+	.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,			\
+	.bMaxBurst = MAX_BURST_SS,					\
+}
+
+struct func_desc {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio source;
+	struct usb_endpoint_descriptor_no_audio sink;
+} __attribute__((packed));
+
+struct ss_func_desc {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio source;
+	struct usb_ss_ep_comp_descriptor source_comp;
+	struct usb_endpoint_descriptor_no_audio sink;
+	struct usb_ss_ep_comp_descriptor sink_comp;
+} __attribute__((packed));
+
+/* v2 descriptors, needed to advertise SuperSpeed endpoints */
 static const struct {
-	struct usb_functionfs_descs_head header;
-	struct {
-		struct usb_interface_descriptor intf;
-		struct usb_endpoint_descriptor_no_audio source;
-		struct usb_endpoint_descriptor_no_audio sink;
-	} __attribute__((packed)) fs_descs, hs_descs;
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	__le32 ss_count;
+	struct func_desc fs_descs, hs_descs;
+	struct ss_func_desc ss_descs;
 } __attribute__((packed)) descriptors = {
 	.header = {
-		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC),
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
 		.length = cpu_to_le32(sizeof(descriptors)),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC |
+				FUNCTIONFS_HAS_HS_DESC |
+				FUNCTIONFS_HAS_SS_DESC),
+	},
+	.fs_count = cpu_to_le32(3),
+	.hs_count = cpu_to_le32(3),
+	.ss_count = cpu_to_le32(5),
+	.fs_descs = {
+		.intf = FASTBOOT_INTF_DESC,
+		.source = FASTBOOT_EP_DESC(1 | USB_DIR_OUT, MAX_PACKET_SIZE_FS),
+		.sink = FASTBOOT_EP_DESC(2 | USB_DIR_IN, MAX_PACKET_SIZE_FS),
+	},
+	.hs_descs = {
+		.intf = FASTBOOT_INTF_DESC,
+		.source = FASTBOOT_EP_DESC(1 | USB_DIR_OUT, MAX_PACKET_SIZE_HS),
+		.sink = FASTBOOT_EP_DESC(2 | USB_DIR_IN, MAX_PACKET_SIZE_HS),
+	},
+	.ss_descs = {
+		.intf = FASTBOOT_INTF_DESC,
+		.source = FASTBOOT_EP_DESC(1 | USB_DIR_OUT, MAX_PACKET_SIZE_SS),
+		.source_comp = FASTBOOT_SS_COMP_DESC,
+		.sink = FASTBOOT_EP_DESC(2 | USB_DIR_IN, MAX_PACKET_SIZE_SS),
+		.sink_comp = FASTBOOT_SS_COMP_DESC,
+	},
+};
+
+/* Legacy format for kernels older than 3.14, full and high speed only */
+static const struct {
+	struct usb_functionfs_descs_head header;
+	struct func_desc fs_descs, hs_descs;
+} __attribute__((packed)) v1_descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC),
+		.length = cpu_to_le32(sizeof(v1_descriptors)),
 		.fs_count = 3,
 		.hs_count = 3,
 	},
 	.fs_descs = {
-		.intf = {
-			.bLength = sizeof(descriptors.fs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bInterfaceNumber = 0,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = ADB_CLASS,
-			.bInterfaceSubClass = ADB_SUBCLASS,
-			.bInterfaceProtocol = FASTBOOT_PROTOCOL,
-			.iInterface = 1, /* first string from the provided table */
-		},
-		.source = {
-			.bLength = sizeof(descriptors.fs_descs.source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_FS,
-		},
-		.sink = {
-			.bLength = sizeof(descriptors.fs_descs.sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_FS,
-		},
+		.intf = FASTBOOT_INTF_DESC,
+		.source = FASTBOOT_EP_DESC(1 | USB_DIR_OUT, MAX_PACKET_SIZE_FS),
+		.sink = FASTBOOT_EP_DESC(2 | USB_DIR_IN, MAX_PACKET_SIZE_FS),
 	},
 	.hs_descs = {
-		.intf = {
-			.bLength = sizeof(descriptors.hs_descs.intf),
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bInterfaceNumber = 0,
-			.bNumEndpoints = 2,
-			.bInterfaceClass = ADB_CLASS,
-			.bInterfaceSubClass = ADB_SUBCLASS,
-			.bInterfaceProtocol = FASTBOOT_PROTOCOL,
-			.iInterface = 1, /* first string from the provided table */
-		},
-		.source = {
-			.bLength = sizeof(descriptors.hs_descs.source),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_HS,
-		},
-		.sink = {
-			.bLength = sizeof(descriptors.hs_descs.sink),
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = MAX_PACKET_SIZE_HS,
-		},
+		.intf = FASTBOOT_INTF_DESC,
+		.source = FASTBOOT_EP_DESC(1 | USB_DIR_OUT, MAX_PACKET_SIZE_HS),
+		.sink = FASTBOOT_EP_DESC(2 | USB_DIR_IN, MAX_PACKET_SIZE_HS),
 	},
 };
 
@@ -170,28 +245,57 @@ static const struct {
 };
 
 
+#define FASTBOOT_CMD_READONLY	(1 << 0)
+#define FASTBOOT_CMD_WINDOWED	(1 << 1)	/* no full mapping */
+
 struct fastboot_cmd {
 	struct fastboot_cmd *next;
 	const char *prefix;
 	unsigned prefix_len;
+	unsigned flags;
 	void (*handle) (char *arg, int fd, void *data, unsigned sz);
 };
 
 static struct fastboot_cmd *cmdlist;
 
-void fastboot_register(const char *prefix,
+static void fastboot_register_flags(const char *prefix,
 		       void (*handle) (char *arg, int fd,
-				       void *data, unsigned sz))
+				       void *data, unsigned sz),
+		       unsigned flags)
 {
 	struct fastboot_cmd *cmd;
 	cmd = xmalloc(sizeof(*cmd));
 	cmd->prefix = prefix;
 	cmd->prefix_len = strlen(prefix);
+	cmd->flags = flags;
 	cmd->handle = handle;
 	cmd->next = cmdlist;
 	cmdlist = cmd;
 }
 
+void fastboot_register(const char *prefix,
+		       void (*handle) (char *arg, int fd,
+				       void *data, unsigned sz))
+{
+	fastboot_register_flags(prefix, handle, 0);
+}
+
+void fastboot_register_readonly(const char *prefix,
+		       void (*handle) (char *arg, int fd,
+				       void *data, unsigned sz))
+{
+	fastboot_register_flags(prefix, handle, FASTBOOT_CMD_READONLY);
+}
+
+void fastboot_register_windowed(const char *prefix,
+		       void (*handle) (char *arg, int fd,
+				       void *data, unsigned sz),
+		       bool readonly)
+{
+	fastboot_register_flags(prefix, handle, FASTBOOT_CMD_WINDOWED |
+			(readonly ? FASTBOOT_CMD_READONLY : 0));
+}
+
 static Hashmap *vars;
 
 void fastboot_publish(char *name, char *value)
@@ -222,35 +326,552 @@ char *fastboot_getvar(char *name)
 	return ret;
 }
 
-static unsigned char buffer[4096];
-
-static unsigned download_size = 0;
-static unsigned long download_max = 0;
-static pid_t fastboot_pid;
-
 #define STATE_OFFLINE	0
 #define STATE_COMMAND	1
 #define STATE_COMPLETE	2
 #define STATE_ERROR	3
+#define STATE_DATA	4	/* in a data phase, can't send INFO */
+
+/* Every connection is served by its own thread. Commands that only
+ * report state run right away; anything that touches the disks or the
+ * device state serializes on action_mutex. */
+struct fastboot_session {
+	unsigned id;
+	int transport;
+	struct io_fds io;
+	unsigned state;
+	unsigned char buffer[4096];
+
+	/* Each session stages downloads in its own memfd */
+	int download_fd;
+	char *download_path;	/* for fastboot_download_file() */
+	unsigned download_size;
+	unsigned staged;	/* bytes reserved against the staging limit */
+	struct download_sink *download_sink;
+
+	/* Digests of the last download, taken as the data arrived */
+	unsigned char download_sha256[DOWNLOAD_DIGEST_LEN];
+	uint32_t download_crc;
+	bool download_digest;
+	unsigned download_seq;	/* bumped by every completed download */
+	/* What getvar download-sha256 and download-crc answer, which
+	 * outlives the download itself */
+	char sha256_var[DOWNLOAD_DIGEST_LEN * 2 + 1];
+	char crc_var[sizeof("0x12345678")];
+	struct data_window download_window;
+
+	/* Data staged for the host to pull with "upload" */
+	char *upload_file;
+	unsigned upload_size;
+
+	struct buf_ring *rx_ring;
+	int splice_pipe[2];
+
+	struct fastboot_session *next;	/* in sessions */
+};
+
+static pthread_key_t session_key;
+
+static struct fastboot_session *session(void)
+{
+	return pthread_getspecific(session_key);
+}
+
+/* Staged data lives in memory, downloads in sealed memfds and uploads on
+ * tmpfs. How much of it there can be follows what the kernel reports as
+ * available, less a reserve for everything else, and is shared between
+ * sessions. */
+#define STAGING_RESERVE_PROP	"ro.userfastboot.mem_reserve"
+#define STAGING_RESERVE		(64UL * 1024 * 1024)
+
+/* Shared memory is backed by huge pages where the kernel allows it, which
+ * cuts page faults and TLB misses on the passes over large images */
+#define SHMEM_HUGE_PROP		"ro.userfastboot.shmem_huge"
+#define SHMEM_HUGE_DEFAULT	"within_size"
+#define SHMEM_HUGE_FILE		"/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE		0x0008
+#endif
+
+static pthread_mutex_t staged_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long staged_bytes;
+static unsigned long staging_reserve;
+
+static uint64_t mem_available(void)
+{
+	char line[128];
+	unsigned long kb = 0, free_kb = 0;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f) {
+		pr_perror("fopen");
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1)
+			break;
+		sscanf(line, "MemFree: %lu kB", &free_kb);
+	}
+	fclose(f);
+
+	/* Kernels before 3.14 don't make the estimate */
+	return (uint64_t)(kb ? kb : free_kb) * 1024;
+}
+
+/* Called with staged_lock held. Staged data already takes up memory, so
+ * it is added back to what's available. */
+static unsigned long staging_limit(void)
+{
+	uint64_t limit = mem_available() + staged_bytes;
+
+	limit = limit > staging_reserve ? limit - staging_reserve : 0;
+	return min(limit, (uint64_t)ULONG_MAX);
+}
+
+/* Downloads that were used are kept around by digest, so the host can
+ * ask for them again with "download-cached" instead of sending them.
+ * Cached downloads count as staged and give way, least recently used
+ * first, whenever new data needs the room. Unless the property sets a
+ * size, the cache may hold a share of the staging limit. A size of 0
+ * gets back the old behavior of dropping each download after use.
+ *
+ * A hit moves the memfd out of the cache to the session and using it
+ * puts it back, so each image is only ever held once. */
+#define DOWNLOAD_CACHE_PROP	"ro.userfastboot.download_cache"
+#define DOWNLOAD_CACHE_SHARE	4	/* a quarter of the staging limit */
+
+struct cache_entry {
+	unsigned char sha256[DOWNLOAD_DIGEST_LEN];
+	uint32_t crc;
+	unsigned size;
+	int fd;
+	struct cache_entry *next;
+};
+
+/* Most recently used first, protected by staged_lock */
+static struct cache_entry *cache;
+static unsigned long cache_bytes;
+static unsigned long cache_max;
+static bool cache_max_set;
+
+/* Called with staged_lock held */
+static unsigned long cache_limit(void)
+{
+	return cache_max_set ? cache_max :
+		staging_limit() / DOWNLOAD_CACHE_SHARE;
+}
+
+/* Called with staged_lock held, the entry's fd is the caller's */
+static void cache_remove(struct cache_entry **pe)
+{
+	struct cache_entry *e = *pe;
+
+	*pe = e->next;
+	cache_bytes -= e->size;
+	staged_bytes -= e->size;
+	free(e);
+}
+
+/* Called with staged_lock held */
+static bool cache_evict_one(void)
+{
+	struct cache_entry **pe;
+
+	if (!cache)
+		return false;
+	for (pe = &cache; (*pe)->next; pe = &(*pe)->next)
+		;
+	pr_debug("evicting %u bytes from the download cache\n", (*pe)->size);
+	close((*pe)->fd);
+	cache_remove(pe);
+	return true;
+}
+
+static bool staged_reserve(unsigned len)
+{
+	unsigned long limit;
+	bool ok;
+
+	pthread_mutex_lock(&staged_lock);
+	limit = staging_limit();
+	while ((uint64_t)staged_bytes + len > limit && cache_evict_one())
+		;
+	ok = (uint64_t)staged_bytes + len <= limit;
+	if (ok)
+		staged_bytes += len;
+	pthread_mutex_unlock(&staged_lock);
+	return ok;
+}
+
+static void staged_release(unsigned len)
+{
+	pthread_mutex_lock(&staged_lock);
+	staged_bytes -= len;
+	pthread_mutex_unlock(&staged_lock);
+}
+
+/* Called with staged_lock held */
+static unsigned long staging_free(void)
+{
+	unsigned long limit = staging_limit();
+
+	return limit > staged_bytes ? limit - staged_bytes : 0;
+}
+
+/* Callers fill the room before they reserve it, so the cache can't be
+ * left to give way later and is dropped up front */
+unsigned long fastboot_staging_room(void)
+{
+	unsigned long room;
+
+	pthread_mutex_lock(&staged_lock);
+	while (cache_evict_one())
+		;
+	room = staging_free();
+	pthread_mutex_unlock(&staged_lock);
+	return room;
+}
+
+/* Downloads reserve before they are received, which evicts cached ones
+ * as needed, so those count as room here */
+static unsigned long download_room(void)
+{
+	unsigned long room;
+
+	pthread_mutex_lock(&staged_lock);
+	room = staging_free() + cache_bytes;
+	pthread_mutex_unlock(&staged_lock);
+	return room;
+}
 
-static unsigned fastboot_state = STATE_OFFLINE;
+
+
+/* Move the session's used download into the cache. On success the
+ * memfd and the staging reservation go with it. */
+static bool cache_put(struct fastboot_session *s)
+{
+	struct cache_entry *e;
+	unsigned long max;
+
+	if (!s->download_digest || !s->staged || s->download_fd < 0)
+		return false;
+
+	pthread_mutex_lock(&staged_lock);
+	max = cache_limit();
+	if (s->staged > max) {
+		pthread_mutex_unlock(&staged_lock);
+		return false;
+	}
+	for (e = cache; e; e = e->next)
+		if (!memcmp(e->sha256, s->download_sha256, DOWNLOAD_DIGEST_LEN))
+			break;
+	if (e) {
+		/* Another session got there first */
+		pthread_mutex_unlock(&staged_lock);
+		return false;
+	}
+
+	e = xmalloc(sizeof(*e));
+	memcpy(e->sha256, s->download_sha256, DOWNLOAD_DIGEST_LEN);
+	e->crc = s->download_crc;
+	e->size = s->staged;
+	e->fd = s->download_fd;
+	e->next = cache;
+	cache = e;
+	cache_bytes += e->size;
+	s->staged = 0;
+	s->download_fd = -1;
+
+	while (cache_bytes > max)
+		cache_evict_one();
+	pthread_mutex_unlock(&staged_lock);
+	return true;
+}
+
+
+/* Hand a cached download to the session. The session must not hold a
+ * download or a reservation. */
+static bool cache_take(struct fastboot_session *s, const unsigned char *sha256,
+		unsigned size)
+{
+	struct cache_entry **pe;
+	bool ok = false;
+
+	pthread_mutex_lock(&staged_lock);
+	for (pe = &cache; *pe; pe = &(*pe)->next)
+		if (!memcmp((*pe)->sha256, sha256, DOWNLOAD_DIGEST_LEN) &&
+				(*pe)->size == size)
+			break;
+	if (!*pe)
+		goto out;
+
+	memcpy(s->download_sha256, sha256, DOWNLOAD_DIGEST_LEN);
+	s->download_crc = (*pe)->crc;
+	s->download_digest = true;
+	s->download_fd = (*pe)->fd;
+	/* Keep the reservation, it's the session's now */
+	staged_bytes += size;
+	cache_remove(pe);
+	s->staged = size;
+	ok = true;
+out:
+	pthread_mutex_unlock(&staged_lock);
+	return ok;
+}
+
+
+/* Done with the session's download: keep it in the cache if possible */
+static void download_discard(struct fastboot_session *s)
+{
+	if (!cache_put(s) && s->download_fd >= 0)
+		close(s->download_fd);
+	s->download_fd = -1;
+	staged_release(s->staged);
+	s->staged = 0;
+	s->download_size = 0;
+	s->download_digest = false;
+}
+
+
+static int memfd_create_compat(const char *name, unsigned flags)
+{
+#ifdef __NR_memfd_create
+	return syscall(__NR_memfd_create, name, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* A new, empty buffer for a download. Kernels without memfd get an
+ * unlinked file on tmpfs instead, which works the same but can't be
+ * sealed. */
+static int download_create(struct fastboot_session *s)
+{
+	char *path;
+	int fd;
+
+	fd = memfd_create_compat("fastboot-download",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0 || errno != ENOSYS) {
+		if (fd < 0)
+			pr_perror("memfd_create");
+		return fd;
+	}
+
+	path = xasprintf("%s.%u", FASTBOOT_DOWNLOAD_TMP_FILE, s->id);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		pr_perror("open");
+	else
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+/* Nothing may change a download once it's complete, whoever else gets
+ * hold of the fd */
+static void download_seal(int fd)
+{
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				F_SEAL_WRITE | F_SEAL_SEAL) &&
+			errno != EINVAL)
+		pr_perror("F_ADD_SEALS");
+}
+
+static void shmem_huge_enable(void)
+{
+	char val[PROPERTY_VALUE_MAX];
+	int fd;
+
+	property_get(SHMEM_HUGE_PROP, val, SHMEM_HUGE_DEFAULT);
+	if (!val[0])
+		return;
+
+	/* Not every kernel has huge pages for shared memory */
+	fd = open(SHMEM_HUGE_FILE, O_WRONLY);
+	if (fd < 0)
+		return;
+	if (write(fd, val, strlen(val)) < 0)
+		pr_perror("write " SHMEM_HUGE_FILE);
+	else
+		pr_debug("shared memory huge pages: %s\n", val);
+	close(fd);
+}
+
+static int tcp_read_full(void *_buf, size_t len)
+{
+	struct fastboot_session *s = session();
+	unsigned char *buf = _buf;
+
+	while (len) {
+		ssize_t r = read(s->io.read_fp, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("read");
+			return -1;
+		} else if (r == 0) {
+			pr_debug("Connection closed\n");
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int tcp_write_full(const void *_buf, size_t len)
+{
+	struct fastboot_session *s = session();
+	const unsigned char *buf = _buf;
+
+	while (len) {
+		ssize_t r = write(s->io.write_fp, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("write");
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Start the next inbound packet, skipping empty ones */
+static int tcp_next_packet(void)
+{
+	struct fastboot_session *s = session();
+	uint64_t be_len;
+
+	while (!s->io.tcp_remaining) {
+		if (tcp_read_full(&be_len, sizeof(be_len)))
+			return -1;
+		s->io.tcp_remaining = be64toh(be_len);
+	}
+	return 0;
+}
+
+/* Outside the data phase we're reading a command, which the host sends
+ * as a single packet that may be shorter than 64 bytes. Download data
+ * is a byte stream that may span any number of packets, so unlike USB
+ * there's no ambiguity when a download happens to be MAGIC_LENGTH. */
+static int tcp_read(void *_buf, unsigned len)
+{
+	struct fastboot_session *s = session();
+	unsigned char *buf = _buf;
+	unsigned count = 0;
+
+	if (s->state != STATE_DATA) {
+		if (tcp_next_packet())
+			return -1;
+		if (s->io.tcp_remaining > len) {
+			pr_error("oversized command packet\n");
+			return -1;
+		}
+		len = s->io.tcp_remaining;
+	}
+
+	while (count < len) {
+		size_t n;
+
+		if (tcp_next_packet())
+			return -1;
+		n = min((uint64_t)(len - count), s->io.tcp_remaining);
+		if (tcp_read_full(buf + count, n))
+			return -1;
+		count += n;
+		s->io.tcp_remaining -= n;
+	}
+	return count;
+}
+
+static int tcp_write(void *buf, unsigned len)
+{
+	unsigned char pkt[sizeof(uint64_t) + MAGIC_LENGTH];
+	uint64_t be_len = htobe64(len);
+
+	/* Keep responses in one segment now that Nagle is off */
+	if (len <= MAGIC_LENGTH) {
+		memcpy(pkt, &be_len, sizeof(be_len));
+		memcpy(pkt + sizeof(be_len), buf, len);
+		if (tcp_write_full(pkt, sizeof(be_len) + len))
+			return -1;
+		return len;
+	}
+
+	if (tcp_write_full(&be_len, sizeof(be_len)) ||
+			tcp_write_full(buf, len))
+		return -1;
+	return len;
+}
+
+/* Both sides send "FB" and a two digit protocol version */
+static int tcp_handshake(void)
+{
+	char hs[TCP_HANDSHAKE_LEN];
+
+	if (tcp_read_full(hs, sizeof(hs)))
+		return -1;
+	if (memcmp(hs, "FB", 2) || !isdigit(hs[2]) || !isdigit(hs[3]) ||
+			(hs[2] == '0' && hs[3] == '0')) {
+		pr_error("bad fastboot TCP handshake\n");
+		return -1;
+	}
+	return tcp_write_full(TCP_HANDSHAKE, TCP_HANDSHAKE_LEN);
+}
 
 static int usb_read(void *_buf, unsigned len)
 {
+	struct fastboot_session *s = session();
 	int r = 0;
 	unsigned xfer;
 	unsigned char *buf = _buf;
 	int count = 0;
 	unsigned const len_orig = len;
 
-	if (fastboot_state == STATE_ERROR)
+	if (s->state == STATE_ERROR)
 		goto oops;
 
 	pr_verbose("usb_read %d\n", len);
+	if (s->io.tcp) {
+		r = tcp_read(buf, len);
+		if (r < 0)
+			goto oops;
+		return r;
+	}
+
+	if (s->io.udp) {
+		r = udp_read(buf, len, s->state != STATE_DATA);
+		if (r < 0)
+			goto oops;
+		return r;
+	}
+
+	if (s->io.aio && len > MAGIC_LENGTH) {
+		r = usb_aio_read(s->io.aio, s->io.read_fp, buf, len);
+		if (r < 0)
+			goto oops;
+		pr_verbose("usb_read complete\n");
+		return r;
+	}
+
 	while (len > 0) {
 		xfer = (len > 4096) ? 4096 : len;
 
-		r = read(io.read_fp, buf, xfer);
+		r = read(s->io.read_fp, buf, xfer);
 		if (r < 0) {
 			pr_warning("read");
 			goto oops;
@@ -271,86 +892,506 @@ static int usb_read(void *_buf, unsigned len)
 		if (len_orig == MAGIC_LENGTH)
 			break;
 	}
-	pr_verbose("usb_read complete\n");
-	return count;
+	pr_verbose("usb_read complete\n");
+	return count;
+
+oops:
+	s->state = STATE_ERROR;
+	return -1;
+}
+
+static int usb_write(void *_buf, unsigned len)
+{
+	struct fastboot_session *s = session();
+	int r;
+	size_t count = 0;
+	unsigned char *buf = _buf;
+
+	pr_verbose("usb_write %d\n", len);
+	if (s->state == STATE_ERROR)
+		goto oops;
+
+	if (s->io.tcp) {
+		r = tcp_write(buf, len);
+		if (r < 0)
+			goto oops;
+		return r;
+	}
+
+	if (s->io.udp) {
+		r = udp_write(buf, len);
+		if (r < 0)
+			goto oops;
+		return r;
+	}
+
+	if (s->io.aio && len > MAGIC_LENGTH) {
+		r = usb_aio_write(s->io.aio, s->io.write_fp, buf, len);
+		if (r < 0)
+			goto oops;
+		return r;
+	}
+
+	do {
+		r = write(s->io.write_fp, buf + count, len - count);
+	if (r < 0) {
+		pr_perror("write");
+		goto oops;
+	}
+		 count += r;
+	} while (count < len);
+
+	return r;
+
+oops:
+	s->state = STATE_ERROR;
+	return -1;
+}
+
+/* Every download is hashed on its way in, so the host can check the
+ * transfer and commands can use the digest without reading the data
+ * again */
+struct rx_digest {
+	SHA256_CTX sha;
+	uLong crc;
+};
+
+static void rx_digest_init(struct rx_digest *d)
+{
+	SHA256_Init(&d->sha);
+	d->crc = crc32(0, NULL, 0);
+}
+
+static void rx_digest_update(struct rx_digest *d, const void *buf, size_t len)
+{
+	SHA256_Update(&d->sha, buf, len);
+	d->crc = crc32(d->crc, buf, len);
+}
+
+/* Downloads over TCP move from the socket to the staging file through
+ * a pipe, so the payload is never copied through userspace */
+#define SPLICE_PIPE_SIZE	(1024 * 1024)
+
+static bool tcp_splice_ok = true;
+
+static void tcp_splice_close(struct fastboot_session *s)
+{
+	close(s->splice_pipe[0]);
+	close(s->splice_pipe[1]);
+	s->splice_pipe[0] = s->splice_pipe[1] = -1;
+}
+
+/* Returns the number of bytes received or -1 on error. If the kernel
+ * can't splice from the socket, clears tcp_splice_ok and returns 0
+ * before anything was consumed. The digest is taken from the staging
+ * file right behind the splice, while the pages are still hot. */
+static int tcp_splice_to_file(int fd, unsigned len, struct rx_digest *digest)
+{
+	struct fastboot_session *s = session();
+	loff_t off = 0, hashed = 0;
+	unsigned count = 0;
+	unsigned char *hbuf = NULL;
+
+	if (s->splice_pipe[0] < 0) {
+		if (pipe(s->splice_pipe)) {
+			pr_perror("pipe");
+			tcp_splice_ok = false;
+			return 0;
+		}
+		/* Best effort, the default 64K pipe works too */
+		fcntl(s->splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	while (count < len) {
+		ssize_t in, out;
+		size_t n;
+
+		if (tcp_next_packet())
+			goto err;
+		n = min((uint64_t)(len - count), s->io.tcp_remaining);
+		in = splice(s->io.read_fp, NULL, s->splice_pipe[1], NULL,
+				min(n, (size_t)SPLICE_PIPE_SIZE),
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!count && (errno == EINVAL || errno == ENOSYS)) {
+				pr_debug("can't splice from socket, copying instead\n");
+				tcp_splice_ok = false;
+				tcp_splice_close(s);
+				free(hbuf);
+				return 0;
+			}
+			pr_perror("splice");
+			goto err;
+		} else if (in == 0) {
+			pr_debug("Connection closed\n");
+			goto err;
+		}
+		s->io.tcp_remaining -= in;
+		count += in;
+
+		while (in) {
+			out = splice(s->splice_pipe[0], NULL, fd, &off, in,
+					SPLICE_F_MOVE);
+			if (out < 0) {
+				if (errno == EINTR)
+					continue;
+				pr_perror("splice");
+				goto err;
+			}
+			in -= out;
+		}
+
+		if (!hbuf)
+			hbuf = xmalloc(SPLICE_PIPE_SIZE);
+		while (hashed < off) {
+			ssize_t r = pread64(fd, hbuf, min((uint64_t)(off - hashed),
+						(uint64_t)SPLICE_PIPE_SIZE), hashed);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				pr_perror("pread64");
+				goto err;
+			}
+			rx_digest_update(digest, hbuf, r);
+			hashed += r;
+		}
+		mui_set_progress((float)count / (float)len);
+	}
+	free(hbuf);
+	return count;
+
+err:
+	/* Whatever is left in the pipe belongs to this download */
+	tcp_splice_close(s);
+	free(hbuf);
+	return -1;
+}
+
+/* Download data is received by the fastboot thread into a ring of
+ * buffers and persisted by a separate writer thread, so the endpoint is
+ * drained while the previous chunk is still being written out. Uploads
+ * use the same ring the other way round. Each session's ring takes at
+ * most RX_RING_MEM, in at least two buffers. Network sessions can be
+ * many and the socket buffers already smooth out their transfers, so
+ * they get smaller rings. */
+#define RX_RING_MEM	(16 * 1024 * 1024)
+#define RX_RING_MIN_BUFS	2
+#define NET_RING_MEM	(4 * 1024 * 1024)
+#define NET_BUF_SIZE	(1024 * 1024)
+
+/* The session's ring, empty and ready for a transfer */
+static struct buf_ring *session_ring(struct fastboot_session *s)
+{
+	size_t bufsize, mem;
+
+	if (!s->rx_ring) {
+		if (s->io.tcp || s->io.udp) {
+			bufsize = NET_BUF_SIZE;
+			mem = NET_RING_MEM;
+		} else {
+			/* As big as the AIO queue, to keep all of it
+			 * busy, if two of those fit */
+			bufsize = XFER_MEM_SIZE;
+			if (s->io.aio)
+				bufsize = max(bufsize,
+						usb_aio_depth * usb_aio_size);
+			bufsize = min(bufsize,
+					(size_t)RX_RING_MEM / RX_RING_MIN_BUFS);
+			mem = RX_RING_MEM;
+		}
+		s->rx_ring = buf_ring_create(mem / bufsize, bufsize);
+	}
+	buf_ring_reset(s->rx_ring);
+	return s->rx_ring;
+}
+
+struct rx_writer {
+	struct buf_ring *ring;
+	int fd;
+	struct download_sink *sink;
+	bool sink_ok;
+	bool failed;
+	struct rx_digest *digest;
+};
+
+static void *rx_writer_thread(void *arg)
+{
+	struct rx_writer *w = arg;
+	void *buf;
+	size_t len;
+
+	while ((buf = buf_ring_get_full(w->ring, &len))) {
+		rx_digest_update(w->digest, buf, len);
+		if (w->sink) {
+			if (w->sink_ok && w->sink->write(w->sink->ctx, buf, len)) {
+				pr_debug("fastboot: sink failed, discarding remaining data\n");
+				w->sink_ok = false;
+			}
+		} else if (robust_write(w->fd, buf, len) != (ssize_t)len) {
+			pr_perror("write");
+			w->failed = true;
+			buf_ring_abort(w->ring);
+			break;
+		}
+		buf_ring_put_free(w->ring);
+	}
+	return NULL;
+}
+
+/* Receive len bytes into fd, or hand them to sink if one is set. If the
+ * sink fails we keep draining the transport so the host gets a proper
+ * FAIL response once the data phase is over. Everything received is
+ * fed to digest. */
+static int usb_read_to_file(int fd, struct download_sink *sink,
+		unsigned int len, struct rx_digest *digest)
+{
+	struct fastboot_session *s = session();
+	struct rx_writer w;
+	pthread_t writer;
+	size_t bufsize;
+	int r = 0;
+	int count = 0;
+	unsigned int orig_len = len;
+
+	if (s->io.tcp && !sink && tcp_splice_ok) {
+		mui_show_progress(1.0, 0);
+		count = tcp_splice_to_file(fd, len, digest);
+		mui_reset_progress();
+		/* Falls through to the copying path if splice isn't supported */
+		if (tcp_splice_ok)
+			return count;
+	}
+
+	bufsize = buf_ring_buf_size(session_ring(s));
+
+	lseek64(fd, 0, SEEK_SET);
+
+	w.ring = s->rx_ring;
+	w.fd = fd;
+	w.sink = sink;
+	w.sink_ok = true;
+	w.failed = false;
+	w.digest = digest;
+	if (pthread_create(&writer, NULL, rx_writer_thread, &w)) {
+		pr_error("couldn't create download writer thread\n");
+		return -1;
+	}
+
+	mui_show_progress(1.0, 0);
+	while (len > 0)
+	{
+		unsigned int size = (len > bufsize) ? bufsize : len;
+		void *buf;
+
+		/* Blocks while the writer is behind; NULL if it gave up */
+		buf = buf_ring_get_free(s->rx_ring);
+		if (!buf) {
+			count = -1;
+			break;
+		}
+		r = usb_read(buf, size);
+		if ((r < 0) || ((unsigned int)r != size)) {
+			pr_error("fastboot: usb_read_to_file error only got %d bytes\n", r);
+			buf_ring_abort(s->rx_ring);
+			count = -1;
+			break;
+		}
+		buf_ring_put_full(s->rx_ring, size);
+		len -= size;
+		count += size;
+		mui_set_progress((float)count / (float)orig_len);
+	}
+	buf_ring_close(s->rx_ring);
+	pthread_join(writer, NULL);
+
+	if (w.failed) {
+		pr_error("fastboot: couldn't store download data\n");
+		s->state = STATE_ERROR;
+		count = -1;
+	}
+	mui_reset_progress();
+	return count;
+}
+
+/* Uploads go the other way: a reader thread fills the ring from the
+ * file while this thread pushes full buffers out to the host */
+struct tx_reader {
+	struct buf_ring *ring;
+	int fd;
+	off64_t offset;
+	unsigned len;
+	bool failed;
+};
+
+static void *tx_reader_thread(void *arg)
+{
+	struct tx_reader *rd = arg;
+	size_t bufsize = buf_ring_buf_size(rd->ring);
+	unsigned done = 0;
+	void *buf;
+
+	while (done < rd->len && (buf = buf_ring_get_free(rd->ring))) {
+		size_t n = min((size_t)(rd->len - done), bufsize);
+		size_t got = 0;
+		ssize_t r;
+
+		while (got < n) {
+			r = pread64(rd->fd, (char *)buf + got, n - got,
+					rd->offset + done + got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				pr_error("upload read failed: %s\n",
+						r ? strerror(errno) : "end of file");
+				rd->failed = true;
+				buf_ring_abort(rd->ring);
+				return NULL;
+			}
+			got += r;
+		}
+		buf_ring_put_full(rd->ring, n);
+		done += n;
+	}
+	buf_ring_close(rd->ring);
+	return NULL;
+}
+
+int fastboot_send_data(int fd, off64_t offset, unsigned len)
+{
+	struct fastboot_session *s = session();
+	char response[MAGIC_LENGTH];
+	struct tx_reader rd;
+	pthread_t reader;
+	unsigned count = 0;
+	void *buf;
+	size_t n;
+
+	sprintf(response, "DATA%08x", len);
+	if (usb_write(response, strlen(response)) < 0)
+		return -1;
+
+	rd.ring = session_ring(s);
+	rd.fd = fd;
+	rd.offset = offset;
+	rd.len = len;
+	rd.failed = false;
+	if (pthread_create(&reader, NULL, tx_reader_thread, &rd)) {
+		pr_error("couldn't create upload reader thread\n");
+		/* The host is already waiting for the data */
+		s->state = STATE_ERROR;
+		return -1;
+	}
+
+	s->state = STATE_DATA;
+	mui_show_progress(1.0, 0);
+	while ((buf = buf_ring_get_full(s->rx_ring, &n))) {
+		if (usb_write(buf, n) < 0) {
+			buf_ring_abort(s->rx_ring);
+			break;
+		}
+		buf_ring_put_free(s->rx_ring);
+		count += n;
+		mui_set_progress((float)count / (float)len);
+	}
+	pthread_join(reader, NULL);
+	mui_reset_progress();
 
-oops:
-	fastboot_state = STATE_ERROR;
-	return -1;
+	/* Past the DATA response there's no way to tell the host about a
+	 * failure except by dropping the connection */
+	if (count != len) {
+		pr_error("fastboot: upload stopped after %u of %u bytes\n",
+				count, len);
+		s->state = STATE_ERROR;
+		return -1;
+	}
+	s->state = STATE_COMMAND;
+	return 0;
 }
 
-static int usb_write(void *_buf, unsigned len)
+static void upload_discard(struct fastboot_session *s)
 {
-	int r;
-	size_t count = 0;
-	unsigned char *buf = _buf;
-
-	pr_verbose("usb_write %d\n", len);
-	if (fastboot_state == STATE_ERROR)
-		goto oops;
-
-	do {
-		r = write(io.write_fp, buf + count, len - count);
-	if (r < 0) {
-		pr_perror("write");
-		goto oops;
-	}
-		 count += r;
-	} while (count < len);
+	if (!s->upload_size)
+		return;
+	unlink(s->upload_file);
+	staged_release(s->upload_size);
+	s->upload_size = 0;
+}
 
-	return r;
+int fastboot_stage_upload_begin(void)
+{
+	struct fastboot_session *s = session();
+	int fd;
 
-oops:
-	fastboot_state = STATE_ERROR;
-	return -1;
+	if (!s)
+		return -1;
+	upload_discard(s);
+	fd = open(s->upload_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		pr_perror("open");
+	return fd;
 }
 
-static int usb_read_to_file(int fd, unsigned int len)
+int fastboot_stage_upload_end(int fd, bool keep)
 {
-	char buf[XFER_MEM_SIZE];
-	int r = 0;
-	int count = 0;
-	unsigned int orig_len = len;
+	struct fastboot_session *s = session();
+	struct stat sb;
+	int ret = -1;
 
-	lseek64(fd, 0, SEEK_SET);
+	if (!keep)
+		goto out;
 
-	mui_show_progress(1.0, 0);
-	while (len > 0)
-	{
-		unsigned int size = (len > XFER_MEM_SIZE) ? XFER_MEM_SIZE : len;
-		r = usb_read(buf, size);
-		if ((r < 0) || ((unsigned int)r != size)) {
-			pr_error("fastboot: usb_read_to_file error only got %d bytes\n", r);
-			count = -1;
-			goto out;
-		}
-		r = write(fd, buf, size);
-		if ((r < 0) || ((unsigned int)r != size)) {
-			pr_perror("write");
-			count = -1;
-			goto out;
-		}
-		len -= size;
-		count += size;
-		mui_set_progress((float)count / (float)orig_len);
+	if (fstat(fd, &sb)) {
+		pr_perror("fstat");
+		goto out;
+	}
+	if (!sb.st_size || sb.st_size > UINT_MAX) {
+		pr_error("can't stage %" PRId64 " bytes for upload\n",
+				(int64_t)sb.st_size);
+		goto out;
 	}
+	if (!staged_reserve(sb.st_size)) {
+		pr_error("no room to stage %" PRId64 " bytes for upload\n",
+				(int64_t)sb.st_size);
+		goto out;
+	}
+	s->upload_size = sb.st_size;
+	ret = 0;
 out:
-	mui_reset_progress();
-	return count;
+	close(fd);
+	if (ret)
+		unlink(s->upload_file);
+	return ret;
+}
+
+int fastboot_stage_upload(const void *data, unsigned len)
+{
+	int fd;
+
+	fd = fastboot_stage_upload_begin();
+	if (fd < 0)
+		return -1;
+	if (robust_write(fd, data, len) != (ssize_t)len) {
+		pr_perror("write");
+		return fastboot_stage_upload_end(fd, false);
+	}
+	return fastboot_stage_upload_end(fd, true);
 }
 
 static void fastboot_ack(const char *code, const char *format, va_list ap)
 {
+	struct fastboot_session *s = session();
 	char response[MAGIC_LENGTH];
 	char reason[MAGIC_LENGTH];
 	int i;
 
 	/* Might be called from a debugging macro. Refuse to do anything
-	 * not on the main Fastboot thread */
-	if (gettid() != fastboot_pid)
+	 * on threads that aren't serving a session */
+	if (!s)
 		return;
 
-	if (fastboot_state != STATE_COMMAND)
+	if (s->state != STATE_COMMAND)
 		return;
 
 	vsnprintf(reason, MAGIC_LENGTH, format, ap);
@@ -373,24 +1414,28 @@ void fastboot_info(const char *fmt, ...)
 
 void fastboot_fail(const char *fmt, ...)
 {
+	struct fastboot_session *s = session();
 	va_list ap;
 
 	va_start(ap, fmt);
 	fastboot_ack("FAIL", fmt, ap);
 	va_end(ap);
 
-	fastboot_state = STATE_COMPLETE;
+	if (s)
+		s->state = STATE_COMPLETE;
 }
 
 void fastboot_okay(const char *fmt, ...)
 {
+	struct fastboot_session *s = session();
 	va_list ap;
 
 	va_start(ap, fmt);
 	fastboot_ack("OKAY", fmt, ap);
 	va_end(ap);
 
-	fastboot_state = STATE_COMPLETE;
+	if (s)
+		s->state = STATE_COMPLETE;
 }
 
 struct getvar_ctx {
@@ -414,18 +1459,55 @@ static bool getvar_all_cb(void *key, void *value, void *context)
 	return true;
 }
 
+/* Variables that follow the asking session or the memory in use are
+ * worked out whenever they're read instead of being published */
+struct live_var {
+	const char *name;
+	char *(*get)(struct fastboot_session *s);
+};
+
+static char *get_download_max(struct fastboot_session *s)
+{
+	unsigned long max;
+
+	if (s->download_sink)
+		max = s->download_sink->max_size;
+	else
+		max = min(download_room(), (unsigned long)UINT_MAX);
+	return xasprintf("0x%lX", max);
+}
+
+static char *get_download_sha256(struct fastboot_session *s)
+{
+	return xstrdup(s->sha256_var);
+}
+
+static char *get_download_crc(struct fastboot_session *s)
+{
+	return xstrdup(s->crc_var);
+}
+
+static const struct live_var live_vars[] = {
+	{ "max-download-size", get_download_max },
+	{ "download-sha256", get_download_sha256 },
+	{ "download-crc", get_download_crc },
+};
+
+#define LIVE_VARS	(int)(sizeof(live_vars) / sizeof(live_vars[0]))
+
 static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
 {
-	const char *value;
+	struct fastboot_session *s = session();
+	char *value;
+	int i;
 
 	pr_debug("fastboot: cmd_getvar %s\n", arg);
 	if (!strcmp(arg, "all")) {
 		struct getvar_ctx ctx;
 		int mapsize;
-		int i;
 
 		hashmapLock(vars);
-		mapsize = hashmapSize(vars);
+		mapsize = hashmapSize(vars) + LIVE_VARS;
 
 		ctx.entries = calloc(mapsize, sizeof(char *));
 		ctx.i = 0;
@@ -433,6 +1515,13 @@ static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
 		hashmapForEach(vars, getvar_all_cb, &ctx);
 		hashmapUnlock(vars);
 
+		for (i = 0; i < LIVE_VARS; i++) {
+			value = live_vars[i].get(s);
+			ctx.entries[ctx.i++] = xasprintf("%s: %s",
+					live_vars[i].name, value);
+			free(value);
+		}
+
 		qsort(ctx.entries, mapsize, sizeof(char *), cmpstringp);
 		for (i = 0; i < mapsize; i++) {
 			fastboot_info("%s", ctx.entries[i]);
@@ -441,189 +1530,381 @@ static void cmd_getvar(char *arg, int fd, void *data, unsigned sz)
 		free(ctx.entries);
 		fastboot_okay("");
 	} else {
-		value = fastboot_getvar(arg);
+		for (i = 0; i < LIVE_VARS; i++) {
+			if (strcmp(arg, live_vars[i].name))
+				continue;
+			value = live_vars[i].get(s);
+			fastboot_okay("%s", value);
+			free(value);
+			return;
+		}
+
+		/* Other sessions may replace the value while we send it */
+		hashmapLock(vars);
+		value = hashmapGet(vars, arg);
+		value = value ? xstrdup(value) : NULL;
+		hashmapUnlock(vars);
 		if (value) {
 			fastboot_okay("%s", value);
+			free(value);
 		} else {
 			fastboot_okay("");
 		}
 	}
 }
 
-static void cmd_download(char *arg, int fd, void *data, unsigned sz)
+void fastboot_set_download_sink(struct download_sink *sink)
+{
+	struct fastboot_session *s = session();
+
+	if (!s)
+		return;
+	s->download_sink = sink;
+}
+
+static void record_download_digest(struct fastboot_session *s)
+{
+	int i;
+
+	for (i = 0; i < DOWNLOAD_DIGEST_LEN; i++)
+		sprintf(s->sha256_var + i * 2, "%02x", s->download_sha256[i]);
+	sprintf(s->crc_var, "0x%08x", s->download_crc);
+}
+
+/* Receive a download of len bytes. If expect is set, the data must have
+ * that SHA-256. */
+static void download(unsigned len, const unsigned char *expect)
 {
+	struct fastboot_session *s = session();
 	char response[MAGIC_LENGTH];
-	unsigned len;
+	struct download_sink *sink;
+	struct rx_digest digest;
+	int fd = -1;
 	int r;
 
-	len = strtoul(arg, NULL, 16);
-	pr_debug("fastboot: cmd_download %d bytes\n", len);
+	pr_debug("fastboot: download %d bytes\n", len);
 	pr_status("Receiving %d bytes\n", len);
 
-	download_size = 0;
-
-	if (len > download_max) {
-		fastboot_fail("data too large");
+	download_discard(s);
+	s->sha256_var[0] = '\0';
+	s->crc_var[0] = '\0';
+
+	/* A sink only ever gets one download, whatever the outcome */
+	sink = s->download_sink;
+	if (sink) {
+		fastboot_set_download_sink(NULL);
+		if (sink->begin(sink->ctx, len)) {
+			sink->end(sink->ctx, false);
+			fastboot_fail("can't stream this download");
+			return;
+		}
+	} else if (!staged_reserve(len)) {
+		fastboot_fail("not enough memory to stage this download");
 		return;
+	} else {
+		s->staged = len;
+		fd = download_create(s);
+		if (fd < 0) {
+			fastboot_fail("can't stage download");
+			return;
+		}
 	}
 
 	sprintf(response, "DATA%08x", len);
-	if (usb_write(response, strlen(response)) < 0)
-		return;
+	if (usb_write(response, strlen(response)) < 0) {
+		if (sink)
+			sink->end(sink->ctx, false);
+		goto out;
+	}
 
-	r = usb_read_to_file(fd, len);
+	s->state = STATE_DATA;
+	rx_digest_init(&digest);
+	r = usb_read_to_file(fd, sink, len, &digest);
 
 	if ((r < 0) || ((unsigned int)r != len)) {
-		pr_error("fastboot: cmd_download error only got %d bytes\n", r);
-		fastboot_state = STATE_ERROR;
+		pr_error("fastboot: download error only got %d bytes\n", r);
+		if (sink)
+			sink->end(sink->ctx, false);
+		s->state = STATE_ERROR;
+		goto out;
+	}
+	s->state = STATE_COMMAND;
+
+	SHA256_Final(s->download_sha256, &digest.sha);
+	if (expect && memcmp(expect, s->download_sha256, DOWNLOAD_DIGEST_LEN)) {
+		pr_error("download doesn't match the announced digest\n");
+		if (sink)
+			sink->end(sink->ctx, false);
+		fastboot_fail("digest mismatch");
+		goto out;
+	}
+	s->download_crc = digest.crc;
+	s->download_digest = true;
+	s->download_seq++;
+	record_download_digest(s);
+
+	if (sink) {
+		/* Nothing was staged, the data is already at its destination */
+		if (sink->end(sink->ctx, true))
+			fastboot_fail("couldn't write streamed data");
+		else
+			fastboot_okay("");
+		goto out;
+	}
+	download_seal(fd);
+	s->download_fd = fd;
+	s->download_size = len;
+	fd = -1;
+	fastboot_okay("");
+out:
+	if (fd >= 0)
+		close(fd);
+}
+
+static void cmd_download(char *arg, int fd, void *data, unsigned sz)
+{
+	download(strtoul(arg, NULL, 16), NULL);
+}
+
+/* download-cached:<sha256>:<size>
+ *
+ * Like download, but the host announces the SHA-256 of the data first.
+ * If the device still holds a download with that digest it answers
+ * OKAY right away, otherwise it asks for the data as usual with DATA
+ * and checks it against the digest. */
+static void cmd_download_cached(char *arg, int fd, void *data, unsigned sz)
+{
+	struct fastboot_session *s = session();
+	unsigned char sha256[DOWNLOAD_DIGEST_LEN];
+	unsigned len;
+	char *end;
+	int i;
+
+	for (i = 0; i < DOWNLOAD_DIGEST_LEN; i++) {
+		if (!isxdigit(arg[i * 2]) || !isxdigit(arg[i * 2 + 1]) ||
+				sscanf(arg + i * 2, "%2hhx", &sha256[i]) != 1)
+			break;
+	}
+	if (i < DOWNLOAD_DIGEST_LEN || arg[i * 2] != ':') {
+		fastboot_fail("usage: download-cached:<sha256>:<size>");
+		return;
+	}
+	len = strtoul(arg + i * 2 + 1, &end, 16);
+	if (*end || end == arg + i * 2 + 1) {
+		fastboot_fail("bad size");
 		return;
 	}
-	download_size = len;
+
+	download_discard(s);
+	if (!cache_take(s, sha256, len)) {
+		download(len, sha256);
+		return;
+	}
+
+	pr_status("Using cached download of %u bytes\n", len);
+	/* The download is staged, not streamed */
+	if (s->download_sink) {
+		s->download_sink->end(s->download_sink->ctx, false);
+		fastboot_set_download_sink(NULL);
+	}
+	s->download_size = len;
+	s->download_seq++;
+	record_download_digest(s);
 	fastboot_okay("");
 }
 
+/* Send whatever a previous command staged, see "fastboot get_staged" */
+static void cmd_upload(char *arg, int fd, void *data, unsigned sz)
+{
+	struct fastboot_session *s = session();
+	int ufd;
+
+	if (!s->upload_size) {
+		fastboot_fail("nothing staged for upload");
+		return;
+	}
+
+	ufd = open(s->upload_file, O_RDONLY);
+	if (ufd < 0) {
+		pr_perror("open");
+		fastboot_fail("staged data lost");
+		upload_discard(s);
+		return;
+	}
+
+	pr_status("Sending %u bytes\n", s->upload_size);
+	if (!fastboot_send_data(ufd, 0, s->upload_size))
+		fastboot_okay("");
+	close(ufd);
+	upload_discard(s);
+}
+
 static void fastboot_command_loop(void)
 {
+	struct fastboot_session *s = session();
 	struct fastboot_cmd *cmd;
 	int r;
 	int fd = -1;
 	void *data;
+	unsigned seq, size;
 
 	pr_debug("fastboot: processing commands\n");
 
 again:
-	while (fastboot_state != STATE_ERROR) {
-		memset(buffer, 0, MAGIC_LENGTH);
-		r = usb_read(buffer, MAGIC_LENGTH);
+	while (s->state != STATE_ERROR) {
+		memset(s->buffer, 0, MAGIC_LENGTH);
+		r = usb_read(s->buffer, MAGIC_LENGTH);
 		if (r < 0)
 			break;
-		buffer[r] = 0;
-		pr_debug("fastboot got command: %s\n", buffer);
+		s->buffer[r] = 0;
+		pr_debug("fastboot got command: %s\n", s->buffer);
 
 		for (cmd = cmdlist; cmd; cmd = cmd->next) {
-			if (memcmp(buffer, cmd->prefix, cmd->prefix_len))
+			if (memcmp(s->buffer, cmd->prefix, cmd->prefix_len))
 				continue;
-			fastboot_state = STATE_COMMAND;
-
-			fd = open(FASTBOOT_DOWNLOAD_TMP_FILE, O_RDWR | O_CREAT, 0600);
-			if (fd < 0) {
-				pr_error("fastboot: cannot open temp file: %s\n",
-					strerror(errno));
-				die();
-			}
-
-			if (download_size) {
-				struct stat sb;
-				if (fstat(fd, &sb)) {
-					pr_perror("fstat");
-					die();
-				}
-
-				if (sb.st_size != download_size) {
-					pr_error("size mismatch! (expected %u vs %" PRIu64 ")\n",
-							download_size, sb.st_size);
-					die();
-				}
-
-				data = mmap64(NULL, download_size, PROT_READ, MAP_SHARED, fd, 0);
-				if (data == (void*)-1) {
+			s->state = STATE_COMMAND;
+
+			fd = s->download_fd;
+			size = s->download_size;
+			seq = s->download_seq;
+			data = NULL;
+			data_window_init(&s->download_window, fd, size);
+
+			if (size && !(cmd->flags & FASTBOOT_CMD_WINDOWED)) {
+				/* Older handlers get all of it at once */
+				data = mmap64(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+				if (data == MAP_FAILED) {
+					/* Likely no room in a 32 bit address
+					 * space, windowed commands still work */
 					pr_perror("mmap64");
-					die();
+					fastboot_fail("download too big for this command");
+					data = NULL;
+					goto done;
 				}
-				pr_verbose("%u bytes mapped\n", download_size);
-			} else {
-				pr_verbose("nothing to mmap\n");
-				data = NULL;
+				pr_verbose("%u bytes mapped\n", size);
 			}
 
-			pthread_mutex_lock(&action_mutex);
+			if (!(cmd->flags & FASTBOOT_CMD_READONLY))
+				pthread_mutex_lock(&action_mutex);
 			pr_verbose("enter command handler\n");
-			cmd->handle((char *)buffer + cmd->prefix_len,
-				    fd, data, download_size);
+			cmd->handle((char *)s->buffer + cmd->prefix_len,
+				    fd, data, s->download_size);
 			pr_verbose("exit command handler\n");
-			pthread_mutex_unlock(&action_mutex);
+			if (!(cmd->flags & FASTBOOT_CMD_READONLY))
+				pthread_mutex_unlock(&action_mutex);
 
-			if (data && munmap(data, download_size)) {
+done:
+			if (data && munmap(data, size)) {
 				pr_perror("munmap");
 				die();
 			}
+			data_window_release(&s->download_window);
 
-			if (close(fd)) {
-				pr_perror("close");
-				die();
-			}
-
-			if (data) {
-				download_size = 0;
-				pr_verbose("deleting temp file\n");
-
-				if (unlink(FASTBOOT_DOWNLOAD_TMP_FILE)) {
-					pr_perror("unlink");
-					die();
-				}
+			/* Unless the command replaced it with a new one,
+			 * the download has been used */
+			if (size && s->download_seq == seq) {
+				pr_verbose("releasing download\n");
+				download_discard(s);
 			}
 
-			if (fastboot_state == STATE_COMMAND)
+			if (s->state == STATE_COMMAND)
 				fastboot_fail("unknown reason");
-			else if (fastboot_state == STATE_COMPLETE)
+			else if (s->state == STATE_COMPLETE)
 				pr_status("Awaiting commands...\n");
 			goto again;
 		}
-		pr_error("unknown command '%s'\n", buffer);
+		pr_error("unknown command '%s'\n", s->buffer);
 		fastboot_fail("unknown command");
 
 	}
-	fastboot_state = STATE_OFFLINE;
+	s->state = STATE_OFFLINE;
 }
 
-static int open_tcp(void)
+static int tcp_bind(int family)
 {
-	pr_verbose("Beginning TCP init\n");
-	int tcp_fd = -1;
-	int portno = 1234;
-	struct sockaddr_in serv_addr;
-
-	pr_verbose("Allocating socket\n");
-	tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (tcp_fd < 0) {
-		pr_error("Socket creation failed: %s\n", strerror(errno));
+	int fd;
+	int on = 1;
+	int off = 0;
+	int bufsize = TCP_SOCK_BUF;
+	struct sockaddr_storage ss;
+	socklen_t len;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0)
 		return -1;
+
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		/* Also accept IPv4 connections as v4-mapped addresses */
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(TCP_PORT);
+		len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(TCP_PORT);
+		len = sizeof(*sin);
 	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	/* Accepted sockets inherit these, and the receive buffer has to be
+	 * set before listen() for the window scale to account for it. We
+	 * run as root, so try to exceed the sysctl limits first. */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bufsize, sizeof(bufsize)))
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
 
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(portno);
 	pr_verbose("Binding socket\n");
-	if (bind(tcp_fd, (struct sockaddr *) &serv_addr,
-		 sizeof(serv_addr)) < 0) {
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
 		pr_error("Bind failure: %s\n", strerror(errno));
-		close(tcp_fd);
+		close(fd);
 		return -1;
 	}
 
 	pr_verbose("Listening socket\n");
-	if (listen(tcp_fd,5)) {
+	if (listen(fd, 5)) {
 		pr_error("Listen failure: %s\n", strerror(errno));
-		close(tcp_fd);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int open_tcp(void)
+{
+	int tcp_fd;
+
+	pr_verbose("Beginning TCP init\n");
+	tcp_fd = tcp_bind(AF_INET6);
+	if (tcp_fd < 0) {
+		pr_debug("No IPv6 listener, falling back to IPv4\n");
+		tcp_fd = tcp_bind(AF_INET);
+	}
+	if (tcp_fd < 0) {
+		pr_error("Couldn't listen on TCP port %d\n", TCP_PORT);
 		return -1;
 	}
 
-	pr_info("Listening on TCP port %d\n", portno);
+	pr_info("Listening on TCP port %d\n", TCP_PORT);
 	return tcp_fd;
 }
 
-static int enable_ffs = 0;
-
-static int open_usb_fd(void)
+static int open_usb_fd(struct io_fds *io)
 {
-	io.read_fp = open(USB_ADB_PATH, O_RDWR);
+	io->read_fp = open(USB_ADB_PATH, O_RDWR);
 	/* tip to reuse same usb_read() and usb_write() than ffs */
-	io.write_fp = io.read_fp;
+	io->write_fp = io->read_fp;
 
-	return io.read_fp;
+	return io->read_fp;
 }
-static int open_usb_ffs(void)
+static int open_usb_ffs(struct io_fds *io)
 {
 	ssize_t ret;
 	int control_fp;
@@ -635,6 +1916,11 @@ static int open_usb_ffs(void)
 	}
 
 	ret = write(control_fp, &descriptors, sizeof(descriptors));
+	if (ret < 0) {
+		pr_debug("[ %s: v2 descriptors rejected: errno=%d, falling back to v1 ]\n",
+				USB_FFS_ADB_EP0, errno);
+		ret = write(control_fp, &v1_descriptors, sizeof(v1_descriptors));
+	}
 	if (ret < 0) {
 		pr_info("[ %s: write descriptors failed: errno=%d ]\n", USB_FFS_ADB_EP0, errno);
 		goto err;
@@ -646,32 +1932,46 @@ static int open_usb_ffs(void)
 		goto err;
 	}
 
-	io.read_fp = open(USB_FFS_ADB_OUT, O_RDWR);
-	if (io.read_fp < 0) {
+	io->read_fp = open(USB_FFS_ADB_OUT, O_RDWR);
+	if (io->read_fp < 0) {
 		pr_info("[ %s: cannot open bulk-out ep: errno=%d ]\n", USB_FFS_ADB_OUT, errno);
 		goto err;
 	}
 
-	io.write_fp = open(USB_FFS_ADB_IN, O_RDWR);
-	if (io.write_fp < 0) {
+	io->write_fp = open(USB_FFS_ADB_IN, O_RDWR);
+	if (io->write_fp < 0) {
 		pr_info("[ %s: cannot open bulk-in ep: errno=%d ]\n", USB_FFS_ADB_IN, errno);
 		goto err;
 	}
 
 	pr_info("Fastboot opened on %s\n", USB_FFS_ADB_PATH);
 
+	/* The AIO context isn't tied to the endpoint files, keep it around
+	 * across reconnects */
+	if (!ffs_aio && usb_aio_depth) {
+		ffs_aio = usb_aio_create(usb_aio_depth, usb_aio_size);
+		if (ffs_aio)
+			pr_debug("Using %u x %zu byte AIO requests\n",
+					usb_aio_depth, usb_aio_size);
+		else {
+			pr_info("AIO unavailable, using synchronous transfers\n");
+			usb_aio_depth = 0;
+		}
+	}
+	io->aio = ffs_aio;
+
 	close(control_fp);
 	control_fp = -1;
-	return io.read_fp;
+	return io->read_fp;
 
 err:
-	if (io.write_fp >= 0) {
-		close(io.write_fp);
-		io.write_fp = -1;
+	if (io->write_fp >= 0) {
+		close(io->write_fp);
+		io->write_fp = -1;
 	}
-	if (io.read_fp >= 0) {
-		close(io.read_fp);
-		io.read_fp = -1;
+	if (io->read_fp >= 0) {
+		close(io->read_fp);
+		io->read_fp = -1;
 	}
 	if (control_fp >= 0) {
 		close(control_fp);
@@ -685,19 +1985,21 @@ err:
  * Opens the file descriptor either using first /dev/android_adb if exists
  * otherwise the ffs one /dev/usb-ffs/adb/
  * */
-static int open_usb(void)
+static int open_usb(struct io_fds *io)
 {
 	int ret = 0;
 	static int printed = 0;
 
-	enable_ffs = 0;
+	memset(io, 0, sizeof(*io));
+	io->read_fp = io->write_fp = -1;
+
 	/* first try /dev/android_adb */
-	ret = open_usb_fd();
+	ret = open_usb_fd(io);
 
 	if (ret < 1) {
     		/* next /dev/usb-ffs/adb */
-    		enable_ffs = 1;
-		ret = open_usb_ffs();
+    		io->ffs = true;
+		ret = open_usb_ffs(io);
     	}
 	if (!printed) {
 		if (ret < 1) {
@@ -705,7 +2007,7 @@ static int open_usb(void)
 				" Listening on TCP only.\n",
 				strerror(errno));
 		} else {
-			if (enable_ffs)
+			if (io->ffs)
 				pr_info("Listening on /dev/usb-ffs/adb/...\n");
 			else
 				pr_info("Listening on /dev/android_adb\n");
@@ -715,71 +2017,316 @@ static int open_usb(void)
 	return ret;
 }
 
+static void close_io(struct io_fds *io)
+{
+	io->aio = NULL;
+	if (io->write_fp >= 0) {
+		close(io->write_fp);
+		if (io->read_fp == io->write_fp)
+			io->read_fp = -1;
+		io->write_fp = -1;
+	}
+	if (io->read_fp >= 0) {
+		close(io->read_fp);
+		io->read_fp = -1;
+	}
+}
+
 /**
- * Force to close file descriptor used at open_usb()
+ * Force to close the file descriptors of the session we're serving
  * */
 void close_iofds(void)
 {
-	if (io.write_fp >= 0) {
-		close(io.write_fp);
-		io.write_fp = -1;
+	struct fastboot_session *s = session();
+
+	if (s)
+		close_io(&s->io);
+}
+
+
+#define TRANSPORT_USB	0
+#define TRANSPORT_TCP	1
+#define TRANSPORT_UDP	2
+#define TRANSPORT_WAKE	3
+
+/* Concurrent TCP connections, on top of one USB and one UDP session */
+#define MAX_TCP_SESSIONS	8
+
+/* Session threads report here when they finish */
+static int wake_pipe[2] = { -1, -1 };
+
+/* Sessions that haven't finished yet */
+static struct fastboot_session *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void session_unlink(struct fastboot_session *s)
+{
+	struct fastboot_session **ps;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (ps = &sessions; *ps; ps = &(*ps)->next) {
+		if (*ps == s) {
+			*ps = s->next;
+			break;
+		}
 	}
-	if (io.read_fp >= 0) {
-		if (enable_ffs)
-			close(io.read_fp);
-		io.read_fp = -1;
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+int fastboot_session_id(void)
+{
+	struct fastboot_session *s = session();
+
+	return s ? (int)s->id : -1;
+}
+
+bool fastboot_session_alive(int id)
+{
+	struct fastboot_session *s;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (s = sessions; s; s = s->next)
+		if ((int)s->id == id)
+			break;
+	pthread_mutex_unlock(&sessions_lock);
+	return s != NULL;
+}
+
+static void *session_thread(void *arg)
+{
+	struct fastboot_session *s = arg;
+	unsigned char transport = s->transport;
+
+	pthread_setspecific(session_key, s);
+	pr_debug("session %u started\n", s->id);
+
+	if (!s->io.tcp || !tcp_handshake())
+		fastboot_command_loop();
+
+	/* The UDP socket belongs to udp.c and outlives the session */
+	if (!s->io.udp)
+		close_io(&s->io);
+	download_discard(s);
+	upload_discard(s);
+	buf_ring_destroy(s->rx_ring);
+	if (s->splice_pipe[0] >= 0)
+		tcp_splice_close(s);
+	if (s->download_sink)
+		s->download_sink->end(s->download_sink->ctx, false);
+	pr_debug("session %u finished\n", s->id);
+
+	session_unlink(s);
+	pthread_setspecific(session_key, NULL);
+	free(s->download_path);
+	free(s->upload_file);
+	free(s);
+
+	while (write(wake_pipe[1], &transport, 1) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+static int session_start(struct io_fds *io, int transport)
+{
+	static unsigned next_id;
+	struct fastboot_session *s;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	s = xmalloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->id = next_id++;
+	s->transport = transport;
+	s->io = *io;
+	s->state = STATE_OFFLINE;
+	s->splice_pipe[0] = s->splice_pipe[1] = -1;
+	s->download_fd = -1;
+	s->upload_file = xasprintf("%s.%u.up", FASTBOOT_DOWNLOAD_TMP_FILE,
+			s->id);
+
+	pthread_mutex_lock(&sessions_lock);
+	s->next = sessions;
+	sessions = s;
+	pthread_mutex_unlock(&sessions_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, session_thread, s);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		pr_error("couldn't start session thread: %s\n", strerror(ret));
+		session_unlink(s);
+		free(s->upload_file);
+		free(s);
+		return -1;
 	}
+	return 0;
 }
 
+static int epoll_watch(int epfd, int fd, int transport)
+{
+	struct epoll_event ev;
 
-int fastboot_handler(void)
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = transport;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		pr_perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+const char *fastboot_download_file(void)
 {
-	int usb_fd_idx = 0;
-	int tcp_fd_idx = 1;
-	int const nfds = 2;
+	struct fastboot_session *s = session();
 
-	struct pollfd fds[nfds];
+	if (!s || s->download_fd < 0)
+		return FASTBOOT_DOWNLOAD_TMP_FILE;
+	free(s->download_path);
+	s->download_path = xasprintf("/proc/self/fd/%d", s->download_fd);
+	return s->download_path;
+}
 
-	memset(&fds, 0, sizeof(fds));
+struct data_window *fastboot_download_data(void)
+{
+	struct fastboot_session *s = session();
 
-	fds[usb_fd_idx].fd = -1;
-	fds[tcp_fd_idx].fd = -1;
+	return s ? &s->download_window : NULL;
+}
 
-	for (;;) {
-		pr_status("Awaiting commands\n");
+bool fastboot_download_digest(unsigned char sha256[DOWNLOAD_DIGEST_LEN],
+		uint32_t *crc)
+{
+	struct fastboot_session *s = session();
+
+	if (!s || !s->download_digest)
+		return false;
+	if (sha256)
+		memcpy(sha256, s->download_sha256, DOWNLOAD_DIGEST_LEN);
+	if (crc)
+		*crc = s->download_crc;
+	return true;
+}
+
+/* The main thread only waits for new connections and hands each one to
+ * a session thread. USB endpoints can't be polled, so the USB session
+ * is started as soon as the endpoints open and blocks in read() until
+ * the host shows up. */
+int fastboot_handler(void)
+{
+	struct epoll_event events[4];
+	struct io_fds io;
+	int epfd;
+	int tcp_fd = -1;
+	int udp_fd = -1;
+	bool usb_busy = false;
+	bool udp_busy = false;
+	unsigned tcp_sessions = 0;
+
+	epfd = epoll_create(4);
+	if (epfd < 0) {
+		pr_perror("epoll_create");
+		return -1;
+	}
+	if (pipe(wake_pipe) || epoll_watch(epfd, wake_pipe[0], TRANSPORT_WAKE)) {
+		pr_perror("wake pipe");
+		return -1;
+	}
 
-		if (fds[usb_fd_idx].fd == -1)
-			fds[usb_fd_idx].fd = open_usb();
-		if (fds[tcp_fd_idx].fd == -1)
-			fds[tcp_fd_idx].fd = open_tcp();
+	pr_status("Awaiting commands\n");
+	for (;;) {
+		int i, n;
 
-		if (fds[usb_fd_idx].fd >= 0)
-			fds[usb_fd_idx].events |= POLLIN;
-		if (fds[tcp_fd_idx].fd >= 0)
-			fds[tcp_fd_idx].events |= POLLIN;
+		if (!usb_busy && open_usb(&io) >= 0) {
+			if (session_start(&io, TRANSPORT_USB))
+				close_io(&io);
+			else
+				usb_busy = true;
+		}
+		if (tcp_fd == -1) {
+			tcp_fd = open_tcp();
+			if (tcp_fd >= 0 && epoll_watch(epfd, tcp_fd, TRANSPORT_TCP)) {
+				close(tcp_fd);
+				tcp_fd = -1;
+			}
+		}
+		if (udp_fd == -1) {
+			udp_fd = udp_open();
+			if (udp_fd >= 0 && epoll_watch(epfd, udp_fd, TRANSPORT_UDP))
+				udp_fd = -1;
+		}
 
-		while (poll(fds, nfds, -1) == -1) {
+		n = epoll_wait(epfd, events, 4, -1);
+		if (n < 0) {
 			if (errno == EINTR)
 				continue;
 			pr_error("Poll failed: %s\n", strerror(errno));
 			return -1;
 		}
 
-		if (fds[usb_fd_idx].revents & POLLIN) {
-			fastboot_command_loop();
-			close_iofds();
-			fds[usb_fd_idx].fd = -1;
-		}
-
-		if (fds[tcp_fd_idx].revents & POLLIN) {
-			io.read_fp = accept(fds[tcp_fd_idx].fd, NULL, NULL);
-			if (io.read_fp < 0)
-				pr_error("Accept failure: %s\n", strerror(errno));
-			else {
-				io.write_fp = io.read_fp;
-				fastboot_command_loop();
+		for (i = 0; i < n; i++) {
+			switch (events[i].data.u32) {
+			case TRANSPORT_WAKE:
+			{
+				unsigned char done;
+
+				if (read(wake_pipe[0], &done, 1) != 1)
+					break;
+				if (done == TRANSPORT_USB) {
+					usb_busy = false;
+				} else if (done == TRANSPORT_TCP) {
+					tcp_sessions--;
+				} else if (done == TRANSPORT_UDP) {
+					udp_busy = false;
+					if (epoll_watch(epfd, udp_fd, TRANSPORT_UDP))
+						udp_fd = -1;
+				}
+				if (!usb_busy && !udp_busy && !tcp_sessions)
+					pr_status("Awaiting commands\n");
+				break;
+			}
+			case TRANSPORT_TCP:
+			{
+				int sock, on = 1;
+
+				sock = accept(tcp_fd, NULL, NULL);
+				if (sock < 0) {
+					pr_error("Accept failure: %s\n", strerror(errno));
+					break;
+				}
+				if (tcp_sessions >= MAX_TCP_SESSIONS) {
+					pr_debug("too many TCP sessions, dropping connection\n");
+					close(sock);
+					break;
+				}
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+						&on, sizeof(on));
+				memset(&io, 0, sizeof(io));
+				io.read_fp = io.write_fp = sock;
+				io.tcp = true;
+				if (session_start(&io, TRANSPORT_TCP))
+					close(sock);
+				else
+					tcp_sessions++;
+				break;
+			}
+			case TRANSPORT_UDP:
+				/* Hand the socket over; the session runs until
+				 * the host goes quiet */
+				epoll_ctl(epfd, EPOLL_CTL_DEL, udp_fd, NULL);
+				memset(&io, 0, sizeof(io));
+				io.read_fp = io.write_fp = -1;
+				io.udp = true;
+				if (session_start(&io, TRANSPORT_UDP)) {
+					if (epoll_watch(epfd, udp_fd, TRANSPORT_UDP))
+						udp_fd = -1;
+				} else {
+					udp_busy = true;
+				}
+				break;
 			}
-			close_iofds();
 		}
 	}
 	return 0;
@@ -795,15 +2342,34 @@ static bool str_equals(void *keyA, void *keyB)
 	return strcmp(keyA, keyB) == 0;
 }
 
-int fastboot_init(unsigned long size)
+int fastboot_init(void)
 {
+	char val[PROPERTY_VALUE_MAX];
+
 	pr_verbose("fastboot_init()\n");
-	download_max = size;
+	property_get(STAGING_RESERVE_PROP, val, "");
+	staging_reserve = val[0] ? strtoul(val, NULL, 0) : STAGING_RESERVE;
+	shmem_huge_enable();
+
+	property_get(USB_AIO_DEPTH_PROP, val, "");
+	usb_aio_depth = val[0] ? strtoul(val, NULL, 0) : USB_AIO_DEPTH;
+	usb_aio_depth = min(usb_aio_depth, (unsigned)USB_AIO_MAX_DEPTH);
+	property_get(USB_AIO_SIZE_PROP, val, "");
+	usb_aio_size = val[0] ? strtoul(val, NULL, 0) : USB_AIO_SIZE;
+	usb_aio_size = min(usb_aio_size, (size_t)USB_AIO_MAX_SIZE);
+	if (!usb_aio_size)
+		usb_aio_depth = 0;
+	property_get(DOWNLOAD_CACHE_PROP, val, "");
+	cache_max_set = val[0];
+	cache_max = cache_max_set ? strtoul(val, NULL, 0) : 0;
 	vars = hashmapCreate(128, str_hash, str_equals);
-	fastboot_register("getvar:", cmd_getvar);
-	fastboot_register("download:", cmd_download);
-	fastboot_publish("max-download-size", xasprintf("0x%lX", download_max));
-	fastboot_pid = gettid();
+	pthread_key_create(&session_key, NULL);
+	/* Downloads land in the session's own memfd */
+	fastboot_register_windowed("getvar:", cmd_getvar, true);
+	fastboot_register_windowed("download:", cmd_download, true);
+	fastboot_register_windowed("download-cached:", cmd_download_cached,
+			true);
+	fastboot_register_windowed("upload", cmd_upload, true);
 
 	return 0;
 }
@@ -30,8 +30,15 @@
 #define __APP_FASTBOOT_H
 #define FASTBOOT_DOWNLOAD_TMP_FILE "/tmp/fstboot.img"
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "data_window.h"
+
 /* Initialize fastboot protocol */
-int fastboot_init(unsigned long size);
+int fastboot_init(void);
 
 /* Begin listening for fastboot commands. Does not return except on fatal errors */
 int fastboot_handler(void);
@@ -44,6 +51,61 @@ int fastboot_handler(void);
 void fastboot_register(const char *prefix,
                        void (*handle)(char *arg, int fd, void *data, unsigned size));
 
+/* Same, for commands that neither touch the disks nor change device
+ * state. These don't take action_mutex, so other sessions can run them
+ * while a long flash is in progress. */
+void fastboot_register_readonly(const char *prefix,
+                       void (*handle)(char *arg, int fd, void *data, unsigned size));
+
+/* Same, for handlers that don't need the download mapped in one piece.
+ * They get data NULL and read it through fastboot_download_data(), so
+ * downloads bigger than the address space work too. */
+void fastboot_register_windowed(const char *prefix,
+                       void (*handle)(char *arg, int fd, void *data, unsigned size),
+                       bool readonly);
+
+/* Identifies the session the calling thread serves, or -1 on threads
+ * that don't serve one */
+int fastboot_session_id(void);
+
+/* Whether the session with this id is still connected */
+bool fastboot_session_alive(int id);
+
+/* The current session's download, for windowed handlers. Empty if
+ * there is none. Valid until the handler returns. */
+struct data_window *fastboot_download_data(void);
+
+/* Path that opens the current session's download, for code that wants
+ * a file name. Valid until the handler returns. */
+const char *fastboot_download_file(void);
+
+/* SHA-256 and CRC32 of the current session's last download, taken as
+ * the data arrived. The host can read them back on the same session as
+ * download-sha256 and download-crc. False if there is no such
+ * download; either pointer may be NULL. */
+#define DOWNLOAD_DIGEST_LEN	32
+bool fastboot_download_digest(unsigned char sha256[DOWNLOAD_DIGEST_LEN],
+		uint32_t *crc);
+
+/* Bytes of tmpfs staging space not claimed by any session. Cached
+ * downloads are dropped to make it. */
+unsigned long fastboot_staging_room(void);
+
+/* Data phase of a command sending data to the host: "DATA" followed by
+ * len bytes of fd starting at offset. The caller still has to OKAY the
+ * command on success; on failure the connection is dropped, since the
+ * host can't be told about it once the data phase started. */
+int fastboot_send_data(int fd, off64_t offset, unsigned len);
+
+/* Stage data on the current session for the host to pull later with
+ * "upload" (fastboot get_staged). fastboot_stage_upload_begin() returns
+ * an empty file to fill in, which fastboot_stage_upload_end() closes and
+ * accounts against the staging space; with keep false it's discarded.
+ * Staging replaces anything staged earlier. */
+int fastboot_stage_upload_begin(void);
+int fastboot_stage_upload_end(int fd, bool keep);
+int fastboot_stage_upload(const void *data, unsigned len);
+
 /* Fetch the value of a fastboot_publish variable */
 char *fastboot_getvar(char *name);
 
@@ -59,10 +121,29 @@ void fastboot_okay(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)))
 void fastboot_publish(char *name, char *value);
 
 /**
- * Force to close file descriptor used at open_usb()
+ * Force to close the file descriptors of the current session
  * */
 void close_iofds(void);
 
+/* Alternate destination for the next download. Instead of staging the
+ * payload in the staging file, each piece of data is handed to write()
+ * as it arrives from the host. Only used for the next download on the
+ * current session, after which the normal staging behavior is restored.
+ * - begin() is called before the data phase; nonzero refuses the download
+ * - write() returning nonzero means the rest of the data is discarded
+ * - end() reports whether the whole transfer arrived and returns nonzero
+ *   if the sink failed at any point
+ * While a sink is set, max-download-size reads as max_size. */
+struct download_sink {
+	int (*begin)(void *ctx, unsigned size);
+	int (*write)(void *ctx, const void *buf, size_t len);
+	int (*end)(void *ctx, bool complete);
+	unsigned max_size;
+	void *ctx;
+};
+
+void fastboot_set_download_sink(struct download_sink *sink);
+
 #endif
 
 /* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
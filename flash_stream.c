@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "erase_queue.h"
+#include "fastboot.h"
+#include "flash_stream.h"
+#include "image_writer.h"
+#include "userfastboot.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+enum stream_state {
+	STREAM_IDLE,
+	STREAM_ARMED,
+	STREAM_ACTIVE,
+	STREAM_DONE,
+	STREAM_FAILED
+};
+
+struct flash_stream {
+	enum stream_state state;
+	int session;	/* the one that armed it, which alone gets the result */
+	char *name;
+	char *device;
+	uint64_t vsize;
+	unsigned size;
+	struct blkwriter *bw;
+	bool failed;
+	bool locked;	/* holding action_mutex */
+
+	struct image_writer iw;
+};
+
+static struct flash_stream stream;
+
+/* Arming and claiming happen under the action lock, but the download in
+ * between doesn't, and other sessions may ask whether a stream is
+ * pending at any time */
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stream_set_state(struct flash_stream *fs, enum stream_state state)
+{
+	pthread_mutex_lock(&stream_lock);
+	fs->state = state;
+	pthread_mutex_unlock(&stream_lock);
+}
+
+
+static int stream_begin(void *ctx, unsigned size)
+{
+	struct flash_stream *fs = ctx;
+
+	/* The download command doesn't take the action lock, but writing
+	 * the partition has to keep out everything that does, from the
+	 * first byte until the last one is written */
+	pthread_mutex_lock(&action_mutex);
+	fs->locked = true;
+
+	if (erase_queue_busy(fs->name)) {
+		pr_error("%s is being erased in the background\n", fs->name);
+		stream_set_state(fs, STREAM_FAILED);
+		return -1;
+	}
+
+	fs->bw = blkwriter_open(fs->device);
+	if (!fs->bw) {
+		stream_set_state(fs, STREAM_FAILED);
+		return -1;
+	}
+
+	pr_status("Streaming %u bytes to %s\n", size, fs->name);
+	stream_set_state(fs, STREAM_ACTIVE);
+	fs->size = size;
+	fs->failed = false;
+	image_writer_init(&fs->iw, fs->bw, fs->vsize);
+	fs->iw.size = size;
+	return 0;
+}
+
+
+static int stream_write(void *ctx, const void *data, size_t len)
+{
+	struct flash_stream *fs = ctx;
+
+	if (fs->failed)
+		return -1;
+
+	if (image_writer_write(&fs->iw, data, len)) {
+		fs->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int stream_end(void *ctx, bool complete)
+{
+	struct flash_stream *fs = ctx;
+
+	if (!complete)
+		fs->failed = true;
+
+	if (fs->failed)
+		image_writer_abort(&fs->iw);
+	else if (image_writer_finish(&fs->iw))
+		fs->failed = true;
+
+	if (fs->bw) {
+		if (blkwriter_close(fs->bw))
+			fs->failed = true;
+		fs->bw = NULL;
+	}
+
+	stream_set_state(fs, fs->failed ? STREAM_FAILED : STREAM_DONE);
+	pr_debug("streamed flash of %s %s\n", fs->name,
+			fs->failed ? "failed" : "complete");
+	if (fs->locked) {
+		fs->locked = false;
+		pthread_mutex_unlock(&action_mutex);
+	}
+	return fs->failed ? -1 : 0;
+}
+
+
+static struct download_sink stream_sink = {
+	.begin = stream_begin,
+	.write = stream_write,
+	.end = stream_end,
+	.ctx = &stream,
+};
+
+
+static void stream_reset(void)
+{
+	free(stream.name);
+	free(stream.device);
+	stream.name = NULL;
+	stream.device = NULL;
+	stream.state = STREAM_IDLE;
+}
+
+
+int flash_stream_arm(const char *name, struct fstab_rec *vol, uint64_t vsize)
+{
+	pthread_mutex_lock(&stream_lock);
+	if (stream.state == STREAM_ARMED || stream.state == STREAM_ACTIVE) {
+		/* Possibly armed by another session, which would then
+		 * write to our partition */
+		pr_error("a streamed flash of %s is already pending\n",
+				stream.name);
+		pthread_mutex_unlock(&stream_lock);
+		return -1;
+	}
+	if (stream.state != STREAM_IDLE &&
+			stream.session != fastboot_session_id() &&
+			fastboot_session_alive(stream.session)) {
+		pr_error("streamed flash of %s hasn't been claimed yet\n",
+				stream.name);
+		pthread_mutex_unlock(&stream_lock);
+		return -1;
+	}
+	stream_reset();
+
+	stream.name = xstrdup(name);
+	stream.device = xstrdup(vol->blk_device);
+	stream.vsize = vsize;
+	stream.session = fastboot_session_id();
+	stream.state = STREAM_ARMED;
+	pthread_mutex_unlock(&stream_lock);
+
+	stream_sink.max_size = min(vsize, (uint64_t)UINT_MAX);
+	fastboot_set_download_sink(&stream_sink);
+	pr_info("Next download will be written directly to %s\n", name);
+	return 0;
+}
+
+
+bool flash_stream_pending(const char *name)
+{
+	bool pending;
+
+	pthread_mutex_lock(&stream_lock);
+	pending = (stream.state == STREAM_ARMED ||
+			stream.state == STREAM_ACTIVE) &&
+		(!name || !strcmp(name, stream.name));
+	pthread_mutex_unlock(&stream_lock);
+	return pending;
+}
+
+
+int flash_stream_claim(const char *name, bool staged)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&stream_lock);
+	if ((stream.state != STREAM_DONE && stream.state != STREAM_FAILED) ||
+			stream.session != fastboot_session_id()) {
+		/* Nothing finished, or another session's to claim */
+		pthread_mutex_unlock(&stream_lock);
+		return 0;
+	}
+
+	if (staged) {
+		pr_debug("dropping stale streamed flash result\n");
+	} else if (stream.state == STREAM_FAILED) {
+		pr_error("streamed flash of %s failed\n", stream.name);
+		ret = -1;
+	} else if (strcmp(name, stream.name)) {
+		pr_error("last download was written to %s, not %s\n",
+				stream.name, name);
+		ret = -1;
+	} else {
+		ret = 1;
+	}
+
+	stream_reset();
+	pthread_mutex_unlock(&stream_lock);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_FLASH_STREAM_H_
+#define _USERFASTBOOT_FLASH_STREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "userfastboot_fstab.h"
+
+/* Arrange for the next download on this session to be written
+ * straight to the partition as it arrives instead of being staged in
+ * /tmp. Raw and sparse images are both accepted. Fails while another
+ * stream is pending or another live session hasn't claimed its
+ * result. */
+int flash_stream_arm(const char *name, struct fstab_rec *vol, uint64_t vsize);
+
+/* Whether a streamed flash to the named partition is armed or under
+ * way. With name NULL, whether there is one to any partition. */
+bool flash_stream_pending(const char *name);
+
+/* Called by the flash command to pick up the result of a streamed
+ * download. Returns 1 if the named partition was streamed successfully,
+ * 0 if there is no streamed download to consume, or -1 if the streamed
+ * download failed or went to a different partition. If staged is true
+ * a newer regular download exists and any stale result is dropped.
+ * Only the session that armed the stream can claim or drop its result. */
+int flash_stream_claim(const char *name, bool staged);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ext4_utils.h>
+
+#include "erase.h"
+#include "format.h"
+#include "userfastboot.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+int format_partition(struct fstab_rec *vol)
+{
+	enum erase_policy policy;
+	uint64_t size;
+	int fd;
+	int ret = -1;
+
+	if (strcmp(vol->fs_type, "ext4")) {
+		pr_error("can't format %s as %s\n", vol->mount_point,
+				vol->fs_type);
+		return -1;
+	}
+
+	if (!is_valid_blkdev(vol->blk_device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+
+	/* Honours length= in the fstab, including the negative lengths
+	 * that leave room for a crypto footer */
+	if (get_volume_size(vol, &size))
+		return -1;
+
+	fd = open(vol->blk_device, O_RDWR);
+	if (fd < 0) {
+		pr_perror("open");
+		return -1;
+	}
+
+	/* make_ext4fs leaves block groups uninitialised and the kernel
+	 * zeroes their inode tables lazily after the first mount, so the
+	 * old contents only need discarding, like make_ext4fs's own wipe
+	 * does. A secure discard is kept where the fstab asks for one;
+	 * headers would leave the old data in place and zeroing the
+	 * whole device takes far too long. */
+	policy = volume_erase_policy(vol);
+	if (policy != ERASE_POLICY_SECURE)
+		policy = ERASE_POLICY_DISCARD;
+
+	mui_show_progress(1.0, 0);
+	if (erase_range(fd, 0, size, policy, NULL, NULL)) {
+		pr_error("couldn't erase %s\n", vol->mount_point);
+		goto out;
+	}
+
+	pr_status("Making %" PRIu64 " byte ext4 filesystem on %s\n",
+			size, vol->mount_point);
+	reset_ext4fs_info();
+	info.len = size;
+	/* Not wiped again, the erase above already did that and
+	 * make_ext4fs's own wipe is always a secure discard */
+	if (make_ext4fs_internal(fd, NULL, vol->mount_point, NULL,
+				0, 0, 0, 0, sehandle, 0, -1, NULL)) {
+		pr_error("make_ext4fs failed on %s\n", vol->mount_point);
+		goto out;
+	}
+
+	if (fsync(fd)) {
+		pr_perror("fsync");
+		goto out;
+	}
+	ret = 0;
+out:
+	mui_reset_progress();
+	close(fd);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
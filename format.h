@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USERFASTBOOT_FORMAT_H_
+#define _USERFASTBOOT_FORMAT_H_
+
+#include "userfastboot_fstab.h"
+
+/* Erase the volume following its fstab erase policy and make an empty
+ * ext4 filesystem on it in place, sized with get_volume_size(). Only
+ * ext4 volumes can be formatted. */
+int format_partition(struct fstab_rec *vol);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -42,6 +42,89 @@
 
 static struct fstab *fstab = NULL;
 
+/* fs_mgr has no use for erase= and drops it, so it is picked out of the
+ * fstab separately */
+struct erase_rule {
+	char *mount_point;
+	enum erase_policy policy;
+	struct erase_rule *next;
+};
+
+static struct erase_rule *erase_rules;
+
+static const char *erase_policy_names[] = {
+	[ERASE_POLICY_SECURE] = "secure",
+	[ERASE_POLICY_DISCARD] = "discard",
+	[ERASE_POLICY_HEADERS] = "headers",
+	[ERASE_POLICY_ZERO] = "zero",
+};
+
+static void parse_erase_flag(const char *mount_point, char *flags)
+{
+	struct erase_rule *rule;
+	char *flag, *saveptr;
+	unsigned i;
+
+	for (flag = strtok_r(flags, ",", &saveptr); flag;
+			flag = strtok_r(NULL, ",", &saveptr)) {
+		if (strncmp(flag, "erase=", 6))
+			continue;
+
+		for (i = 0; i < sizeof(erase_policy_names) /
+				sizeof(erase_policy_names[0]); i++)
+			if (!strcmp(flag + 6, erase_policy_names[i]))
+				break;
+		if (i == sizeof(erase_policy_names) /
+				sizeof(erase_policy_names[0])) {
+			pr_error("unknown erase policy for %s: %s\n",
+					mount_point, flag + 6);
+			continue;
+		}
+
+		rule = xmalloc(sizeof(*rule));
+		rule->mount_point = xstrdup(mount_point);
+		rule->policy = i;
+		rule->next = erase_rules;
+		erase_rules = rule;
+	}
+}
+
+static void load_erase_rules(const char *path)
+{
+	char line[1024];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *fields[5], *saveptr, *p;
+		int n;
+
+		p = line;
+		for (n = 0; n < 5; n++, p = NULL) {
+			fields[n] = strtok_r(p, " \t\n", &saveptr);
+			if (!fields[n])
+				break;
+		}
+		if (n < 5 || fields[0][0] == '#')
+			continue;
+		parse_erase_flag(fields[1], fields[4]);
+	}
+	fclose(f);
+}
+
+enum erase_policy volume_erase_policy(struct fstab_rec *vol)
+{
+	struct erase_rule *rule;
+
+	for (rule = erase_rules; rule; rule = rule->next)
+		if (!strcmp(rule->mount_point, vol->mount_point))
+			return rule->policy;
+	return ERASE_POLICY_SECURE;
+}
+
 void load_volume_table()
 {
 	int i;
@@ -52,6 +135,7 @@ void load_volume_table()
 		pr_error("failed to read /etc/recovery.fstab\n");
 		return;
 	}
+	load_erase_rules("/etc/recovery.fstab");
 
 	ret = fs_mgr_add_entry(fstab, "/tmp", "ramdisk", "ramdisk");
 	if (ret < 0) {
@@ -65,8 +149,9 @@ void load_volume_table()
 	pr_debug("=========================\n");
 	for (i = 0; i < fstab->num_entries; ++i) {
 		struct fstab_rec *v = &fstab->recs[i];
-		pr_debug("  %d %s %s %s %lld\n", i, v->mount_point, v->fs_type,
-			 v->blk_device, v->length);
+		pr_debug("  %d %s %s %s %lld erase=%s\n", i, v->mount_point,
+			 v->fs_type, v->blk_device, v->length,
+			 erase_policy_names[volume_erase_policy(v)]);
 	}
 	printf("\n");
 }
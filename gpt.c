@@ -287,7 +287,7 @@ int cmd_flash_gpt(Hashmap *params, int fd, void *data, unsigned sz)
 
 	memset(&ctx, 0, sizeof(ctx));
 
-	ctx.config = iniparser_load(FASTBOOT_DOWNLOAD_TMP_FILE);
+	ctx.config = iniparser_load(fastboot_download_file());
 	if (!ctx.config) {
 		pr_error("Couldn't parse GPT config\n");
 		return -1;
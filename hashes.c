@@ -40,6 +40,12 @@
 #include <stdio.h>
 #include <ftw.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <bootimg.h>
 #include <ext4_utils.h>
@@ -385,6 +391,157 @@ out:
 	return ret;
 }
 
+
+/* Block maps are read in segments of many blocks, handed out to worker
+ * threads in order so the device mostly sees sequential reads */
+#define BLOCK_MAP_SEGMENT	(4 * 1024 * 1024)
+#define BLOCK_MAP_MAX_THREADS	8
+
+struct block_map_ctx {
+	int fd;
+	uint64_t offset;
+	uint64_t len;
+	uint32_t block_size;
+	size_t segment;
+	unsigned char *digests;
+
+	pthread_mutex_t lock;
+	uint64_t next;		/* next segment to hand out */
+	uint64_t done;
+	bool failed;
+};
+
+static void *block_map_thread(void *arg)
+{
+	struct block_map_ctx *ctx = arg;
+	unsigned char *buf = xmalloc(ctx->segment);
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	for (;;) {
+		uint64_t start, blk;
+		size_t n, got = 0, pos;
+		ssize_t r;
+		bool failed;
+
+		pthread_mutex_lock(&ctx->lock);
+		start = ctx->next;
+		ctx->next += ctx->segment;
+		failed = ctx->failed;
+		pthread_mutex_unlock(&ctx->lock);
+		if (start >= ctx->len || failed)
+			break;
+
+		n = min((uint64_t)ctx->segment, ctx->len - start);
+		while (got < n) {
+			r = pread64(ctx->fd, buf + got, n - got,
+					ctx->offset + start + got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				pr_error("read failed at %" PRIu64 "\n",
+						ctx->offset + start + got);
+				pthread_mutex_lock(&ctx->lock);
+				ctx->failed = true;
+				pthread_mutex_unlock(&ctx->lock);
+				goto out;
+			}
+			got += r;
+		}
+
+		blk = start / ctx->block_size;
+		for (pos = 0; pos < n; pos += ctx->block_size, blk++) {
+			SHA256(buf + pos, min((size_t)ctx->block_size, n - pos),
+					hash);
+			memcpy(ctx->digests + blk * BLOCK_MAP_DIGEST_SIZE, hash,
+					BLOCK_MAP_DIGEST_SIZE);
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->done += n;
+		mui_set_progress((float)ctx->done / (float)ctx->len);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+out:
+	free(buf);
+	return NULL;
+}
+
+
+size_t block_map_size(uint64_t len, uint32_t block_size)
+{
+	uint64_t count = (len + block_size - 1) / block_size;
+
+	if (count > (SIZE_MAX - sizeof(struct block_map_header)) /
+			BLOCK_MAP_DIGEST_SIZE)
+		return SIZE_MAX;
+	return sizeof(struct block_map_header) + count * BLOCK_MAP_DIGEST_SIZE;
+}
+
+
+void *get_block_map(int fd, uint64_t offset, uint64_t len,
+		uint32_t block_size, size_t *map_len)
+{
+	struct block_map_ctx ctx;
+	struct block_map_header *hdr;
+	pthread_t threads[BLOCK_MAP_MAX_THREADS];
+	uint64_t count;
+	long ncpu;
+	int i, n;
+
+	if (!block_size || BLOCK_MAP_SEGMENT % block_size) {
+		pr_error("block size must divide %d\n", BLOCK_MAP_SEGMENT);
+		return NULL;
+	}
+	count = (len + block_size - 1) / block_size;
+
+	*map_len = block_map_size(len, block_size);
+	/* Can be big; not having the memory mustn't be fatal */
+	hdr = *map_len == SIZE_MAX ? NULL : malloc(*map_len);
+	if (!hdr) {
+		pr_error("no memory for a %" PRIu64 " block map\n", count);
+		return NULL;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fd = fd;
+	ctx.offset = offset;
+	ctx.len = len;
+	ctx.block_size = block_size;
+	ctx.segment = BLOCK_MAP_SEGMENT;
+	pthread_mutex_init(&ctx.lock, NULL);
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, BLOCK_MAP_MAGIC, sizeof(hdr->magic));
+	hdr->block_size = htole32(block_size);
+	hdr->digest_size = htole32(BLOCK_MAP_DIGEST_SIZE);
+	hdr->offset = htole64(offset);
+	hdr->length = htole64(len);
+	hdr->block_count = htole64(count);
+	ctx.digests = (unsigned char *)(hdr + 1);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = ncpu < 1 ? 1 : min(ncpu, (long)BLOCK_MAP_MAX_THREADS);
+
+	posix_fadvise64(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+	mui_show_progress(1.0, 0);
+	for (n = 0; n < ncpu; n++)
+		if (pthread_create(&threads[n], NULL, block_map_thread, &ctx))
+			break;
+	if (!n)
+		block_map_thread(&ctx);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	mui_reset_progress();
+	pthread_mutex_destroy(&ctx.lock);
+
+	if (ctx.failed) {
+		free(hdr);
+		return NULL;
+	}
+	pr_debug("block map: %" PRIu64 " blocks of %u bytes, %d threads\n",
+			count, block_size, n);
+	return hdr;
+}
+
 /* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
  */
 
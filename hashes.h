@@ -33,8 +33,35 @@
 #ifndef _HASHES_H_
 #define _HASHES_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 int get_fat_file_hashes(const char *ptn);
 int get_boot_image_hash(const char *ptn);
 int get_ext_image_hash(const char *ptn);
 
+/* Per-block digest map of len bytes of fd starting at offset, for hosts
+ * that want to send only the blocks that changed. The map is a header
+ * followed by one truncated SHA-256 digest per block, the last block
+ * possibly being short. All fields are little endian. */
+#define BLOCK_MAP_MAGIC		"UFBBMAP1"
+#define BLOCK_MAP_DIGEST_SIZE	16
+
+struct block_map_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t digest_size;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t block_count;
+} __attribute__((packed));
+
+/* Size of the map get_block_map() would return, without reading
+ * anything. SIZE_MAX if it wouldn't fit in memory at all. */
+size_t block_map_size(uint64_t len, uint32_t block_size);
+
+/* Returns a malloc'd map and its size in map_len, or NULL on error */
+void *get_block_map(int fd, uint64_t offset, uint64_t len,
+		uint32_t block_size, size_t *map_len);
+
 #endif
@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "image_writer.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define FILL_BUF_SIZE	(1024 * 1024)
+#define SECTOR_SIZE	512
+
+/* Delta mode reads the device DELTA_READ_SIZE at a time, split between
+ * DELTA_READERS threads so the device sees several requests at once,
+ * and compares in DELTA_BLOCK units. Reads under DELTA_SPLIT_MIN are
+ * done with a single pread on the caller's thread. */
+#define DELTA_READ_SIZE	(16 * 1024 * 1024)
+#define DELTA_READERS	4
+#define DELTA_SPLIT_MIN	(1024 * 1024)
+#define DELTA_BLOCK	4096
+
+struct delta_read {
+	unsigned char *buf;
+	size_t len;
+	uint64_t offset;
+	int ret;
+};
+
+/* Reader threads kept for the writer's lifetime. The caller posts up
+ * to DELTA_READERS slices and takes slices itself until none are left,
+ * so it also works with no threads at all. */
+struct delta_readers {
+	int fd;
+	pthread_t threads[DELTA_READERS - 1];
+	int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct delta_read slices[DELTA_READERS];
+	int nslices;
+	int next;
+	int pending;
+	bool stop;
+};
+
+static int delta_pread(int fd, unsigned char *buf, size_t len,
+		uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t r = pread64(fd, buf + done, len - done, offset + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			pr_debug("delta read at %" PRIu64 ": %s\n",
+					offset + done,
+					r ? strerror(errno) : "end of device");
+			return -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+
+/* Takes and reads slices until all have been handed out. Called and
+ * returns with dr->lock held. */
+static void delta_take_slices(struct delta_readers *dr)
+{
+	while (dr->next < dr->nslices) {
+		struct delta_read *sl = &dr->slices[dr->next++];
+
+		pthread_mutex_unlock(&dr->lock);
+		sl->ret = delta_pread(dr->fd, sl->buf, sl->len, sl->offset);
+		pthread_mutex_lock(&dr->lock);
+		if (!--dr->pending)
+			pthread_cond_broadcast(&dr->cond);
+	}
+}
+
+
+static void *delta_read_thread(void *arg)
+{
+	struct delta_readers *dr = arg;
+
+	pthread_mutex_lock(&dr->lock);
+	while (!dr->stop) {
+		if (dr->next < dr->nslices)
+			delta_take_slices(dr);
+		else
+			pthread_cond_wait(&dr->cond, &dr->lock);
+	}
+	pthread_mutex_unlock(&dr->lock);
+	return NULL;
+}
+
+
+static struct delta_readers *delta_readers_start(int fd)
+{
+	struct delta_readers *dr;
+
+	dr = xmalloc(sizeof(*dr));
+	memset(dr, 0, sizeof(*dr));
+	dr->fd = fd;
+	pthread_mutex_init(&dr->lock, NULL);
+	pthread_cond_init(&dr->cond, NULL);
+	/* Fewer threads just means the caller reads more itself */
+	while (dr->nthreads < DELTA_READERS - 1 &&
+			!pthread_create(&dr->threads[dr->nthreads], NULL,
+				delta_read_thread, dr))
+		dr->nthreads++;
+	return dr;
+}
+
+
+static void delta_readers_stop(struct delta_readers *dr)
+{
+	int i;
+
+	pthread_mutex_lock(&dr->lock);
+	dr->stop = true;
+	pthread_cond_broadcast(&dr->cond);
+	pthread_mutex_unlock(&dr->lock);
+	for (i = 0; i < dr->nthreads; i++)
+		pthread_join(dr->threads[i], NULL);
+	pthread_cond_destroy(&dr->cond);
+	pthread_mutex_destroy(&dr->lock);
+	free(dr);
+}
+
+
+static int delta_read(struct image_writer *iw, size_t len, uint64_t offset)
+{
+	struct delta_readers *dr = iw->delta_readers;
+	size_t slice = (len / DELTA_READERS + DELTA_BLOCK) & ~(DELTA_BLOCK - 1);
+	size_t pos = 0;
+	int i, ret = 0;
+
+	if (len < DELTA_SPLIT_MIN || !dr->nthreads) {
+		ret = delta_pread(iw->delta_fd, iw->delta_buf, len, offset);
+		goto out;
+	}
+
+	pthread_mutex_lock(&dr->lock);
+	for (i = 0; i < DELTA_READERS && pos < len; i++) {
+		dr->slices[i].buf = iw->delta_buf + pos;
+		dr->slices[i].len = min(slice, len - pos);
+		dr->slices[i].offset = offset + pos;
+		dr->slices[i].ret = 0;
+		pos += dr->slices[i].len;
+	}
+	dr->nslices = dr->pending = i;
+	dr->next = 0;
+	pthread_cond_broadcast(&dr->cond);
+
+	delta_take_slices(dr);
+	while (dr->pending)
+		pthread_cond_wait(&dr->cond, &dr->lock);
+	for (i = 0; i < dr->nslices; i++)
+		ret |= dr->slices[i].ret;
+	dr->nslices = 0;
+	pthread_mutex_unlock(&dr->lock);
+
+out:
+	/* Don't let the old contents pile up in the page cache */
+	posix_fadvise64(iw->delta_fd, offset, len, POSIX_FADV_DONTNEED);
+	return ret;
+}
+
+
+static int iw_delta_write(struct image_writer *iw, const unsigned char *buf,
+		size_t len, uint64_t offset)
+{
+	while (len) {
+		size_t n = min(len, (size_t)DELTA_READ_SIZE);
+		size_t pos = 0;
+
+		if (delta_read(iw, n, offset)) {
+			/* Can't tell, so write it */
+			iw->delta_written += n;
+			if (blkwriter_write(iw->bw, buf, n, offset))
+				return -1;
+		} else while (pos < n) {
+			/* Compare in blocks aligned on the device */
+			size_t blk = min(n - pos, DELTA_BLOCK -
+					(size_t)((offset + pos) % DELTA_BLOCK));
+
+			if (memcmp(buf + pos, iw->delta_buf + pos, blk)) {
+				iw->delta_written += blk;
+				if (blkwriter_write(iw->bw, buf + pos, blk,
+							offset + pos))
+					return -1;
+			} else {
+				iw->delta_skipped += blk;
+			}
+			pos += blk;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+static int iw_write(struct image_writer *iw, const void *buf, size_t len,
+		uint64_t offset)
+{
+	if (iw->delta_buf)
+		return iw_delta_write(iw, buf, len, offset);
+	return blkwriter_write(iw->bw, buf, len, offset);
+}
+
+
+static int iw_sparse_begin(void *ctx, uint64_t size)
+{
+	struct image_writer *iw = ctx;
+
+	if (size > iw->vsize) {
+		pr_error("need %" PRIu64 " bytes, have %" PRIu64 " available\n",
+				size, iw->vsize);
+		return -1;
+	}
+	return 0;
+}
+
+
+static int iw_sparse_raw(void *ctx, uint64_t offset, const void *data,
+		size_t len)
+{
+	struct image_writer *iw = ctx;
+
+	if (iw_write(iw, data, len, offset))
+		return -1;
+	if (iw->verify)
+		return verifier_data(iw->verify, data, len, offset);
+	return 0;
+}
+
+
+/* Returns 0 if the ioctl took care of the range, otherwise the range
+ * needs to be written out */
+static int iw_range_ioctl(struct image_writer *iw, unsigned long req,
+		uint64_t offset, uint64_t len, bool *unsupported)
+{
+	uint64_t range[2] = { offset, len };
+
+	if (*unsupported || offset % SECTOR_SIZE || len % SECTOR_SIZE)
+		return -1;
+
+	/* The range can't overlap anything still queued, sparse chunks
+	 * don't overlap and raw images never get here */
+	if (ioctl(blkwriter_fd(iw->bw), req, range)) {
+		/* Not a block device, or the device can't do it */
+		pr_debug("%s: %s, not using it again\n",
+				req == BLKZEROOUT ? "BLKZEROOUT" : "BLKDISCARD",
+				strerror(errno));
+		*unsupported = true;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int iw_sparse_fill(void *ctx, uint64_t offset, uint64_t len,
+		uint32_t value)
+{
+	struct image_writer *iw = ctx;
+	uint32_t *words;
+	uint64_t pos = 0;
+	size_t i;
+
+	/* Zeroing would rewrite blocks that might already match */
+	if (!value && !iw->delta_buf && !iw_range_ioctl(iw, BLKZEROOUT,
+				offset, len, &iw->no_zeroout))
+		goto out;
+
+	if (!iw->fill_buf) {
+		iw->fill_buf = xmalloc(FILL_BUF_SIZE);
+		iw->fill_val = ~value;
+	}
+
+	if (iw->fill_val != value) {
+		words = (uint32_t *)iw->fill_buf;
+		for (i = 0; i < FILL_BUF_SIZE / sizeof(*words); i++)
+			words[i] = value;
+		iw->fill_val = value;
+	}
+
+	while (pos < len) {
+		size_t chunk = min(len - pos, (uint64_t)FILL_BUF_SIZE);
+
+		if (iw_write(iw, iw->fill_buf, chunk, offset + pos))
+			return -1;
+		pos += chunk;
+	}
+out:
+	if (iw->verify)
+		return verifier_fill(iw->verify, offset, len, value);
+	return 0;
+}
+
+
+static int iw_sparse_skip(void *ctx, uint64_t offset, uint64_t len)
+{
+	struct image_writer *iw = ctx;
+
+	/* Best effort, the contents are undefined either way */
+	if (iw->discard)
+		iw_range_ioctl(iw, BLKDISCARD, offset, len, &iw->no_discard);
+	return 0;
+}
+
+
+static const struct sparse_stream_ops iw_sparse_ops = {
+	.begin = iw_sparse_begin,
+	.raw = iw_sparse_raw,
+	.fill = iw_sparse_fill,
+	.skip = iw_sparse_skip,
+};
+
+
+static int iw_data(struct image_writer *iw, const void *buf, size_t len)
+{
+	if (iw->sparse)
+		return sparse_stream_write(&iw->ss, buf, len);
+
+	if (len > iw->vsize - iw->offset) {
+		pr_error("image doesn't fit, only %" PRIu64 " bytes available\n",
+				iw->vsize);
+		return -1;
+	}
+	if (iw_write(iw, buf, len, iw->offset))
+		return -1;
+	if (iw->verify && verifier_data(iw->verify, buf, len, iw->offset))
+		return -1;
+	iw->offset += len;
+	return 0;
+}
+
+
+static int iw_detect(struct image_writer *iw)
+{
+	iw->detected = true;
+	iw->sparse = is_sparse_image(iw->magic, iw->magic_len);
+
+	if (iw->sparse) {
+		sparse_stream_init(&iw->ss, &iw_sparse_ops, iw);
+	} else if (iw->size > iw->vsize) {
+		pr_error("need %" PRIu64 ", %" PRIu64 " available\n",
+				iw->size, iw->vsize);
+		return -1;
+	}
+	pr_debug("writing %s image\n", iw->sparse ? "sparse" : "raw");
+
+	/* Replay the bytes we held back */
+	return iw_data(iw, iw->magic, iw->magic_len);
+}
+
+
+void image_writer_init(struct image_writer *iw, struct blkwriter *bw,
+		uint64_t vsize)
+{
+	memset(iw, 0, sizeof(*iw));
+	iw->bw = bw;
+	iw->vsize = vsize;
+}
+
+
+int image_writer_write(struct image_writer *iw, const void *data, size_t len)
+{
+	const unsigned char *buf = data;
+
+	if (!iw->detected) {
+		size_t n = min(len, sizeof(iw->magic) - iw->magic_len);
+
+		memcpy(iw->magic + iw->magic_len, buf, n);
+		iw->magic_len += n;
+		buf += n;
+		len -= n;
+
+		if (iw->magic_len < sizeof(iw->magic))
+			return 0;
+
+		if (iw_detect(iw))
+			return -1;
+	}
+
+	if (len && iw_data(iw, buf, len))
+		return -1;
+	return 0;
+}
+
+
+int image_writer_finish(struct image_writer *iw)
+{
+	int ret = 0;
+
+	/* Images shorter than the magic can only be raw */
+	if (!iw->detected)
+		ret = iw_detect(iw);
+
+	if (!ret && iw->sparse)
+		ret = sparse_stream_finish(&iw->ss);
+
+	if (!ret && iw->delta_buf)
+		pr_info("%" PRIu64 " blocks written, %" PRIu64 " unchanged\n",
+				(iw->delta_written + DELTA_BLOCK - 1) / DELTA_BLOCK,
+				iw->delta_skipped / DELTA_BLOCK);
+
+	if (!ret && iw->verify) {
+		ret = verifier_finish(iw->verify);
+		iw->verify = NULL;
+	}
+
+	image_writer_abort(iw);
+	return ret;
+}
+
+
+int image_writer_set_delta(struct image_writer *iw, const char *filename)
+{
+	iw->delta_fd = open(filename, O_RDONLY);
+	if (iw->delta_fd < 0) {
+		pr_error("Couldn't open %s for reading: %s\n", filename,
+				strerror(errno));
+		return -1;
+	}
+	iw->delta_buf = xmalloc(DELTA_READ_SIZE);
+	iw->delta_readers = delta_readers_start(iw->delta_fd);
+	return 0;
+}
+
+
+int image_writer_set_verify(struct image_writer *iw, const char *filename)
+{
+	iw->verify = verifier_start(filename, iw->bw);
+	return iw->verify ? 0 : -1;
+}
+
+
+void image_writer_abort(struct image_writer *iw)
+{
+	if (iw->verify) {
+		verifier_abort(iw->verify);
+		iw->verify = NULL;
+	}
+	free(iw->fill_buf);
+	iw->fill_buf = NULL;
+	if (iw->delta_buf) {
+		delta_readers_stop(iw->delta_readers);
+		iw->delta_readers = NULL;
+		close(iw->delta_fd);
+		free(iw->delta_buf);
+		iw->delta_buf = NULL;
+	}
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
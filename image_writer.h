@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_IMAGE_WRITER_H_
+#define _USERFASTBOOT_IMAGE_WRITER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "blkwriter.h"
+#include "sparse_stream.h"
+#include "verifier.h"
+
+struct delta_readers;
+
+/* Writes an image to a partition as it is produced, in pieces of any
+ * size. Whether the image is raw or sparse is decided once the first
+ * few bytes have arrived. Nothing is ever written past vsize. Zero
+ * fills use BLKZEROOUT where the device supports it, and DONT_CARE
+ * chunks are skipped. */
+struct image_writer {
+	struct blkwriter *bw;
+	uint64_t vsize;
+
+	/* Size of the incoming data if known up front, otherwise 0. Raw
+	 * images that won't fit are then refused before anything is
+	 * written. */
+	uint64_t size;
+
+	/* Discard DONT_CARE areas instead of leaving them alone */
+	bool discard;
+
+	/* Delta mode: compare against what's on the device and only write
+	 * the blocks that differ. See image_writer_set_delta(). */
+	int delta_fd;
+	unsigned char *delta_buf;
+	struct delta_readers *delta_readers;
+	uint64_t delta_written;
+	uint64_t delta_skipped;
+	/* Read back and check everything written, see
+	 * image_writer_set_verify() */
+	struct verifier *verify;
+
+	/* Set once the device turned out not to support the ioctls */
+	bool no_zeroout;
+	bool no_discard;
+
+	/* We can't tell raw from sparse until the magic has arrived */
+	unsigned char magic[SPARSE_STREAM_MIN_HEADER];
+	size_t magic_len;
+	bool detected;
+	bool sparse;
+
+	uint64_t offset;
+	struct sparse_stream ss;
+
+	unsigned char *fill_buf;
+	uint32_t fill_val;
+};
+
+void image_writer_init(struct image_writer *iw, struct blkwriter *bw,
+		uint64_t vsize);
+int image_writer_write(struct image_writer *iw, const void *data, size_t len);
+
+/* Flushes held back bytes and checks that a sparse image was complete.
+ * Always releases the writer's resources; bw is left to the caller. */
+int image_writer_finish(struct image_writer *iw);
+
+/* Read back the current contents of filename, the device bw writes to,
+ * and skip writing blocks that already match */
+int image_writer_set_delta(struct image_writer *iw, const char *filename);
+
+/* Read back what gets written to filename, the device bw writes to,
+ * while the flash goes on and fail on the first mismatch. DONT_CARE
+ * areas of sparse images aren't checked. */
+int image_writer_set_verify(struct image_writer *iw, const char *filename);
+
+/* Release the writer's resources after a failure */
+void image_writer_abort(struct image_writer *iw);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -39,6 +39,7 @@
 
 #include "userfastboot_ui.h"
 #include "userfastboot_util.h"
+#include "sanity.h"
 
 /* We have a vague requirment to do sanity checks on any bootloader
  * update operations. Since the userfastboot boot image is an extension
@@ -53,11 +54,12 @@
 
 
 /* Make sure this is a valid AOSP boot image */
-int bootimage_sanity_checks(unsigned char *data, size_t size)
+int bootimage_sanity_checks(struct data_window *dw)
 {
-	struct boot_img_hdr *hdr = (struct boot_img_hdr *)data;
+	const struct boot_img_hdr *hdr;
 
-	if (size < sizeof(*hdr)) {
+	hdr = data_window_map(dw, 0, sizeof(*hdr));
+	if (!hdr) {
 		pr_error("image too small for even the boot image header!\n");
 		return -1;
 	}
@@ -17,7 +17,9 @@
 #ifndef _USERFASTBOOT_SANITY_H_
 #define _USERFASTBOOT_SANITY_H_
 
-int bootimage_sanity_checks(unsigned char *data, size_t size);
+#include "data_window.h"
+
+int bootimage_sanity_checks(struct data_window *dw);
 int esp_sanity_checks(const char *path);
 
 #endif
@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "sparse_stream.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+int is_sparse_image(const void *data, size_t len)
+{
+	uint32_t magic;
+
+	if (len < sizeof(magic))
+		return 0;
+
+	memcpy(&magic, data, sizeof(magic));
+	return magic == SPARSE_HEADER_MAGIC;
+}
+
+
+/* CRC32 of len bytes of a repeated 32-bit word, appended to crc. The
+ * CRC of a run is built up by doubling, so large fills cost next to
+ * nothing. */
+static uint32_t crc_fill(uint32_t crc, uint32_t word, uint64_t len)
+{
+	uint32_t run_crc = crc32(0, (const Bytef *)&word, sizeof(word));
+	uint64_t run_len = sizeof(word);
+	uint64_t words = len / sizeof(word);
+
+	while (words) {
+		if (words & 1)
+			crc = crc32_combine64(crc, run_crc, run_len);
+		run_crc = crc32_combine64(run_crc, run_crc, run_len);
+		run_len *= 2;
+		words >>= 1;
+	}
+	return crc;
+}
+
+
+static uint32_t crc_data(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while (len) {
+		uInt n = min(len, (size_t)UINT32_MAX);
+
+		crc = crc32(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+	return crc;
+}
+
+
+void sparse_stream_init(struct sparse_stream *ss,
+		const struct sparse_stream_ops *ops, void *ctx)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->ops = ops;
+	ss->ctx = ctx;
+	ss->state = SPARSE_STATE_HEADER;
+}
+
+
+static int parse_file_header(struct sparse_stream *ss)
+{
+	sparse_header_t *sh = &ss->header;
+
+	memcpy(sh, ss->hdr_buf, sizeof(*sh));
+
+	if (sh->magic != SPARSE_HEADER_MAGIC) {
+		pr_error("bad sparse magic 0x%08x\n", sh->magic);
+		return -1;
+	}
+
+	if (sh->major_version != 1) {
+		pr_error("unsupported sparse version %u.%u\n",
+				sh->major_version, sh->minor_version);
+		return -1;
+	}
+
+	if (sh->file_hdr_sz < sizeof(sparse_header_t) ||
+			sh->chunk_hdr_sz < sizeof(chunk_header_t)) {
+		pr_error("sparse header sizes too small\n");
+		return -1;
+	}
+
+	if (!sh->blk_sz || sh->blk_sz % 4) {
+		pr_error("bad sparse block size %u\n", sh->blk_sz);
+		return -1;
+	}
+
+	ss->size = (uint64_t)sh->blk_sz * (uint64_t)sh->total_blks;
+	pr_verbose("sparse image: %u chunks, %" PRIu64 " bytes expanded\n",
+			sh->total_chunks, ss->size);
+
+	if (ss->ops->begin && ss->ops->begin(ss->ctx, ss->size))
+		return -1;
+
+	return 0;
+}
+
+
+static void next_chunk(struct sparse_stream *ss)
+{
+	ss->chunks_done++;
+	ss->hdr_pos = 0;
+	if (ss->chunks_done == ss->header.total_chunks)
+		ss->state = SPARSE_STATE_DONE;
+	else
+		ss->state = SPARSE_STATE_CHUNK_HEADER;
+}
+
+
+static int start_chunk(struct sparse_stream *ss)
+{
+	chunk_header_t *ch = &ss->chunk;
+	uint64_t data_sz;
+
+	memcpy(ch, ss->hdr_buf, sizeof(*ch));
+
+	if (ch->total_sz < ss->header.chunk_hdr_sz) {
+		pr_error("sparse chunk %u: bad total size %u\n",
+				ss->chunks_done, ch->total_sz);
+		return -1;
+	}
+	data_sz = ch->total_sz - ss->header.chunk_hdr_sz;
+	ss->chunk_len = (uint64_t)ch->chunk_sz * ss->header.blk_sz;
+
+	if (ch->chunk_type != CHUNK_TYPE_CRC32 &&
+			ss->offset + ss->chunk_len > ss->size) {
+		pr_error("sparse chunk %u extends past end of image\n",
+				ss->chunks_done);
+		return -1;
+	}
+
+	switch (ch->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		if (data_sz != ss->chunk_len) {
+			pr_error("sparse chunk %u: raw size mismatch\n",
+					ss->chunks_done);
+			return -1;
+		}
+		break;
+	case CHUNK_TYPE_FILL:
+	case CHUNK_TYPE_CRC32:
+		if (data_sz != sizeof(ss->word_buf)) {
+			pr_error("sparse chunk %u: bad fill/crc size\n",
+					ss->chunks_done);
+			return -1;
+		}
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		if (data_sz) {
+			pr_error("sparse chunk %u: don't care chunk has data\n",
+					ss->chunks_done);
+			return -1;
+		}
+		if (ss->ops->skip && ss->ops->skip(ss->ctx, ss->offset,
+					ss->chunk_len))
+			return -1;
+		ss->crc = crc_fill(ss->crc, 0, ss->chunk_len);
+		ss->offset += ss->chunk_len;
+		next_chunk(ss);
+		return 0;
+	default:
+		pr_error("sparse chunk %u: unknown type 0x%04x\n",
+				ss->chunks_done, ch->chunk_type);
+		return -1;
+	}
+
+	ss->data_remaining = data_sz;
+	if (data_sz)
+		ss->state = SPARSE_STATE_CHUNK_DATA;
+	else
+		next_chunk(ss);
+	return 0;
+}
+
+
+/* Consume header bytes for either the file header or a chunk header.
+ * Returns the number of bytes used, or -1 on error */
+static ssize_t consume_header(struct sparse_stream *ss,
+		const unsigned char *buf, size_t len)
+{
+	size_t parse_sz, total_sz, n;
+
+	if (ss->state == SPARSE_STATE_HEADER) {
+		parse_sz = sizeof(sparse_header_t);
+		total_sz = ss->hdr_pos < parse_sz ? parse_sz :
+				ss->header.file_hdr_sz;
+	} else {
+		parse_sz = sizeof(chunk_header_t);
+		total_sz = ss->hdr_pos < parse_sz ? parse_sz :
+				ss->header.chunk_hdr_sz;
+	}
+
+	n = min(len, total_sz - ss->hdr_pos);
+	if (ss->hdr_pos < parse_sz)
+		memcpy(ss->hdr_buf + ss->hdr_pos, buf, n);
+	ss->hdr_pos += n;
+
+	if (ss->hdr_pos == parse_sz && ss->state == SPARSE_STATE_HEADER) {
+		if (parse_file_header(ss))
+			return -1;
+	}
+
+	/* Now that the sizes are known, is the whole header here? */
+	if (ss->state == SPARSE_STATE_HEADER) {
+		if (ss->hdr_pos < parse_sz ||
+				ss->hdr_pos < ss->header.file_hdr_sz)
+			return n;
+		ss->hdr_pos = 0;
+		if (ss->header.total_chunks)
+			ss->state = SPARSE_STATE_CHUNK_HEADER;
+		else
+			ss->state = SPARSE_STATE_DONE;
+	} else {
+		if (ss->hdr_pos < parse_sz ||
+				ss->hdr_pos < ss->header.chunk_hdr_sz)
+			return n;
+		if (start_chunk(ss))
+			return -1;
+	}
+	return n;
+}
+
+
+static ssize_t consume_data(struct sparse_stream *ss,
+		const unsigned char *buf, size_t len)
+{
+	size_t n = min(len, ss->data_remaining);
+	uint32_t word;
+
+	if (ss->chunk.chunk_type == CHUNK_TYPE_RAW) {
+		if (ss->ops->raw(ss->ctx, ss->offset, buf, n))
+			return -1;
+		ss->crc = crc_data(ss->crc, buf, n);
+		ss->offset += n;
+		ss->data_remaining -= n;
+		if (!ss->data_remaining)
+			next_chunk(ss);
+		return n;
+	}
+
+	/* FILL and CRC32 carry a single 32-bit word */
+	memcpy(ss->word_buf + sizeof(ss->word_buf) - ss->data_remaining,
+			buf, n);
+	ss->data_remaining -= n;
+	if (ss->data_remaining)
+		return n;
+
+	memcpy(&word, ss->word_buf, sizeof(word));
+	if (ss->chunk.chunk_type == CHUNK_TYPE_FILL) {
+		if (ss->ops->fill(ss->ctx, ss->offset, ss->chunk_len, word))
+			return -1;
+		ss->crc = crc_fill(ss->crc, word, ss->chunk_len);
+		ss->offset += ss->chunk_len;
+	} else if (word != ss->crc) {
+		pr_error("sparse chunk %u: CRC mismatch, expected 0x%08x got 0x%08x\n",
+				ss->chunks_done, word, ss->crc);
+		return -1;
+	}
+	next_chunk(ss);
+	return n;
+}
+
+
+int sparse_stream_write(struct sparse_stream *ss, const void *data, size_t len)
+{
+	const unsigned char *buf = data;
+	ssize_t n;
+
+	while (len) {
+		switch (ss->state) {
+		case SPARSE_STATE_HEADER:
+		case SPARSE_STATE_CHUNK_HEADER:
+			n = consume_header(ss, buf, len);
+			break;
+		case SPARSE_STATE_CHUNK_DATA:
+			n = consume_data(ss, buf, len);
+			break;
+		case SPARSE_STATE_DONE:
+			pr_error("%zu bytes of trailing data after sparse image\n",
+					len);
+			n = -1;
+			break;
+		default:
+			n = -1;
+		}
+
+		if (n < 0) {
+			ss->state = SPARSE_STATE_ERROR;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+int sparse_stream_finish(struct sparse_stream *ss)
+{
+	if (ss->state != SPARSE_STATE_DONE) {
+		pr_error("truncated sparse image (%u chunks processed)\n",
+				ss->chunks_done);
+		return -1;
+	}
+
+	/* Like libsparse, treat any area not described by a chunk as
+	 * don't care */
+	if (ss->offset < ss->size && ss->ops->skip &&
+			ss->ops->skip(ss->ctx, ss->offset, ss->size - ss->offset))
+		return -1;
+
+	return 0;
+}
+
+
+/* Encoder side. The image is written out sequentially; RAW chunk
+ * headers are filled in with pwrite once their run of blocks ends, and
+ * the file header once everything is done. */
+#define SPARSE_ENCODE_BUF	(4 * 1024 * 1024)
+
+struct sparse_encoder {
+	int out;
+	uint64_t pos;
+	uint64_t max_size;
+	uint32_t blk_sz;
+	uint32_t total_chunks;
+
+	/* Run of blocks not yet closed off */
+	uint16_t type;
+	uint32_t fill;
+	uint32_t blocks;
+	uint64_t hdr_pos;
+};
+
+static int enc_write(struct sparse_encoder *e, const void *buf, size_t len)
+{
+	if (e->pos + len > e->max_size) {
+		pr_error("sparse image would exceed %" PRIu64 " bytes\n",
+				e->max_size);
+		return -1;
+	}
+	if (robust_write(e->out, buf, len) != (ssize_t)len) {
+		pr_perror("write");
+		return -1;
+	}
+	e->pos += len;
+	return 0;
+}
+
+static int enc_pwrite(struct sparse_encoder *e, const void *buf, size_t len,
+		uint64_t offset)
+{
+	if (pwrite64(e->out, buf, len, offset) != (ssize_t)len) {
+		pr_perror("pwrite64");
+		return -1;
+	}
+	return 0;
+}
+
+static int enc_flush(struct sparse_encoder *e)
+{
+	chunk_header_t ch;
+
+	if (!e->blocks)
+		return 0;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.chunk_type = e->type;
+	ch.chunk_sz = e->blocks;
+	if (e->type == CHUNK_TYPE_FILL) {
+		ch.total_sz = sizeof(ch) + sizeof(e->fill);
+		if (enc_write(e, &ch, sizeof(ch)) ||
+				enc_write(e, &e->fill, sizeof(e->fill)))
+			return -1;
+	} else {
+		ch.total_sz = sizeof(ch) + e->blocks * e->blk_sz;
+		if (enc_pwrite(e, &ch, sizeof(ch), e->hdr_pos))
+			return -1;
+	}
+	e->total_chunks++;
+	e->blocks = 0;
+	return 0;
+}
+
+static int enc_fill(struct sparse_encoder *e, uint32_t value)
+{
+	if (e->blocks && (e->type != CHUNK_TYPE_FILL || e->fill != value))
+		if (enc_flush(e))
+			return -1;
+	e->type = CHUNK_TYPE_FILL;
+	e->fill = value;
+	e->blocks++;
+	return 0;
+}
+
+static int enc_raw(struct sparse_encoder *e, const unsigned char *data,
+		uint32_t count)
+{
+	/* chunk total_sz is 32 bits, long runs get split */
+	uint32_t max_blocks = (UINT32_MAX - sizeof(chunk_header_t)) / e->blk_sz;
+	chunk_header_t ch;
+
+	while (count) {
+		uint32_t n;
+
+		if (e->blocks && (e->type != CHUNK_TYPE_RAW ||
+					e->blocks == max_blocks))
+			if (enc_flush(e))
+				return -1;
+		if (!e->blocks) {
+			e->type = CHUNK_TYPE_RAW;
+			e->hdr_pos = e->pos;
+			memset(&ch, 0, sizeof(ch));
+			if (enc_write(e, &ch, sizeof(ch)))
+				return -1;
+		}
+
+		n = min(count, max_blocks - e->blocks);
+		if (enc_write(e, data, (size_t)n * e->blk_sz))
+			return -1;
+		e->blocks += n;
+		data += (size_t)n * e->blk_sz;
+		count -= n;
+	}
+	return 0;
+}
+
+/* A block is a fill block iff it equals itself shifted by one word */
+static bool is_fill_block(const unsigned char *blk, uint32_t blk_sz)
+{
+	return !memcmp(blk, blk + sizeof(uint32_t), blk_sz - sizeof(uint32_t));
+}
+
+int64_t sparse_encode(int in, uint64_t offset, uint64_t len, uint32_t blk_sz,
+		int out, uint64_t max_size)
+{
+	struct sparse_encoder e;
+	sparse_header_t hdr;
+	unsigned char *buf;
+	uint64_t done = 0;
+	int64_t ret = -1;
+
+	if (!blk_sz || blk_sz % sizeof(uint32_t) ||
+			SPARSE_ENCODE_BUF % blk_sz || len % blk_sz) {
+		pr_error("can't encode %" PRIu64 " bytes in %u byte blocks\n",
+				len, blk_sz);
+		return -1;
+	}
+	if (len / blk_sz > UINT32_MAX) {
+		pr_error("too many blocks for a sparse image\n");
+		return -1;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.out = out;
+	e.max_size = max_size;
+	e.blk_sz = blk_sz;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SPARSE_HEADER_MAGIC;
+	hdr.major_version = 1;
+	hdr.minor_version = 0;
+	hdr.file_hdr_sz = sizeof(sparse_header_t);
+	hdr.chunk_hdr_sz = sizeof(chunk_header_t);
+	hdr.blk_sz = blk_sz;
+	hdr.total_blks = len / blk_sz;
+	if (enc_write(&e, &hdr, sizeof(hdr)))
+		return -1;
+
+	buf = xmalloc(SPARSE_ENCODE_BUF);
+	posix_fadvise64(in, offset, len, POSIX_FADV_SEQUENTIAL);
+	while (done < len) {
+		size_t n = min((uint64_t)SPARSE_ENCODE_BUF, len - done);
+		uint32_t nblk = n / blk_sz;
+		uint32_t i, j;
+		ssize_t r;
+		size_t got = 0;
+
+		while (got < n) {
+			r = pread64(in, buf + got, n - got, offset + done + got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				pr_error("read failed at %" PRIu64 ": %s\n",
+						offset + done + got,
+						r ? strerror(errno) : "end of file");
+				goto out;
+			}
+			got += r;
+		}
+
+		for (i = 0; i < nblk; i = j) {
+			const unsigned char *blk = buf + (size_t)i * blk_sz;
+			uint32_t value;
+
+			if (is_fill_block(blk, blk_sz)) {
+				memcpy(&value, blk, sizeof(value));
+				if (enc_fill(&e, value))
+					goto out;
+				j = i + 1;
+				continue;
+			}
+			for (j = i + 1; j < nblk && !is_fill_block(buf +
+						(size_t)j * blk_sz, blk_sz); j++)
+				;
+			if (enc_raw(&e, blk, j - i))
+				goto out;
+		}
+		done += n;
+		mui_set_progress((float)done / (float)len);
+	}
+
+	if (enc_flush(&e))
+		goto out;
+	hdr.total_chunks = e.total_chunks;
+	if (enc_pwrite(&e, &hdr, sizeof(hdr), 0))
+		goto out;
+
+	pr_debug("encoded %" PRIu64 " bytes as %u chunks, %" PRIu64 " bytes\n",
+			len, e.total_chunks, e.pos);
+	ret = e.pos;
+out:
+	free(buf);
+	return ret;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_SPARSE_STREAM_H_
+#define _USERFASTBOOT_SPARSE_STREAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sparse_format.h>
+
+/* Push-style decoder for Android sparse images. Data can be fed in
+ * arbitrarily sized pieces as it becomes available; the decoder never
+ * needs to see the whole image at once. Offsets passed to the callbacks
+ * are byte offsets into the expanded image. Any callback returning
+ * nonzero aborts decoding. */
+struct sparse_stream_ops {
+	/* Called once the file header is parsed, with the expanded size */
+	int (*begin)(void *ctx, uint64_t size);
+	/* RAW chunk payload. May be called several times per chunk. */
+	int (*raw)(void *ctx, uint64_t offset, const void *data, size_t len);
+	/* FILL chunk: len bytes of the repeated 32-bit value */
+	int (*fill)(void *ctx, uint64_t offset, uint64_t len, uint32_t value);
+	/* DONT_CARE chunk, or trailing area not covered by any chunk */
+	int (*skip)(void *ctx, uint64_t offset, uint64_t len);
+};
+
+enum sparse_stream_state {
+	SPARSE_STATE_HEADER,
+	SPARSE_STATE_CHUNK_HEADER,
+	SPARSE_STATE_CHUNK_DATA,
+	SPARSE_STATE_DONE,
+	SPARSE_STATE_ERROR
+};
+
+struct sparse_stream {
+	const struct sparse_stream_ops *ops;
+	void *ctx;
+	enum sparse_stream_state state;
+
+	sparse_header_t header;
+	chunk_header_t chunk;
+
+	/* Header bytes consumed so far. We only keep the part we parse,
+	 * anything beyond that (file_hdr_sz/chunk_hdr_sz) is skipped */
+	size_t hdr_pos;
+	unsigned char hdr_buf[sizeof(sparse_header_t)];
+
+	/* Payload bytes left in the current chunk, and the number of
+	 * image bytes the chunk expands to */
+	uint64_t data_remaining;
+	uint64_t chunk_len;
+	unsigned char word_buf[4];
+
+	uint64_t offset;
+	uint64_t size;
+	uint32_t chunks_done;
+
+	/* Running CRC32 of the expanded image, checked against any CRC32
+	 * chunks. DONT_CARE areas count as zeros, as in libsparse. */
+	uint32_t crc;
+};
+
+#define SPARSE_STREAM_MIN_HEADER	sizeof(uint32_t)
+
+void sparse_stream_init(struct sparse_stream *ss,
+		const struct sparse_stream_ops *ops, void *ctx);
+int sparse_stream_write(struct sparse_stream *ss, const void *data, size_t len);
+int sparse_stream_finish(struct sparse_stream *ss);
+
+/* True if the buffer begins with the sparse header magic */
+int is_sparse_image(const void *data, size_t len);
+
+/* Encode len bytes of in starting at offset as a sparse image written to
+ * out, which must be empty. Blocks made of a single repeated 32-bit value
+ * become FILL chunks, everything else is RAW. len must be a multiple of
+ * blk_sz. Returns the size of the image, or -1 on error or if it would
+ * be larger than max_size. */
+int64_t sparse_encode(int in, uint64_t offset, uint64_t len, uint32_t blk_sz,
+		int out, uint64_t max_size);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cutils/properties.h>
+
+#include "fastboot.h"
+#include "udp.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+#define UDP_PORT		5554
+#define UDP_VERSION		1
+#define UDP_HEADER_SIZE		4
+/* Largest packet that fits a 1500 byte MTU over IPv6 */
+#define UDP_MAX_PACKET		1452
+#define UDP_MIN_PACKET		512
+#define UDP_SOCK_BUF		(4 * 1024 * 1024)
+#define UDP_IDLE_TIMEOUT_MS	5000
+
+/* How many host packets may be in flight past the next one we expect.
+ * The stock host is stop-and-wait and never uses more than one; hosts
+ * that know about this read it from the udp-window variable. */
+#define UDP_WINDOW_PROP		"ro.userfastboot.udp_window"
+#define UDP_DEFAULT_WINDOW	32
+#define UDP_MAX_WINDOW		256
+
+#define UDP_ID_ERROR		0x00
+#define UDP_ID_QUERY		0x01
+#define UDP_ID_INIT		0x02
+#define UDP_ID_FASTBOOT		0x03
+
+#define UDP_FLAG_CONTINUATION	0x01
+
+struct udp_slot {
+	bool used;
+	uint16_t seq;
+	uint8_t flags;
+	size_t len;
+	unsigned char data[UDP_MAX_PACKET - UDP_HEADER_SIZE];
+};
+
+static struct {
+	int fd;
+
+	bool active;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	uint16_t seq;		/* next sequence number expected from host */
+	size_t max_payload;
+	unsigned window;
+	struct udp_slot *slots;	/* packets that arrived ahead of seq */
+
+	/* Response to the last in-order packet, sent again if the host
+	 * retransmits because it was lost */
+	unsigned char last[UDP_MAX_PACKET];
+	size_t last_len;
+	uint16_t last_seq;
+	bool have_last;
+
+	/* An empty host packet asking for data we don't have yet */
+	bool poll_pending;
+	uint16_t poll_seq;
+
+	/* In-order payload from the host not consumed yet */
+	unsigned char *rx;
+	size_t rx_size;
+	size_t rx_start;
+	size_t rx_end;
+	bool rx_msg_done;
+
+	/* Host started over in the middle of a transfer */
+	bool reset;
+} udp = {
+	.fd = -1,
+};
+
+
+static uint16_t get_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+
+static int udp_send(const struct sockaddr_storage *to, socklen_t to_len,
+		uint8_t id, uint8_t flags, uint16_t seq,
+		const void *data, size_t len, bool keep)
+{
+	unsigned char pkt[UDP_MAX_PACKET];
+	ssize_t r;
+
+	pkt[0] = id;
+	pkt[1] = flags;
+	put_be16(pkt + 2, seq);
+	if (len)
+		memcpy(pkt + UDP_HEADER_SIZE, data, len);
+	len += UDP_HEADER_SIZE;
+
+	if (keep) {
+		memcpy(udp.last, pkt, len);
+		udp.last_len = len;
+		udp.last_seq = seq;
+		udp.have_last = true;
+	}
+
+	do {
+		r = sendto(udp.fd, pkt, len, 0, (const struct sockaddr *)to,
+				to_len);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		pr_perror("sendto");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int udp_respond(uint16_t seq, uint8_t flags, const void *data,
+		size_t len, bool keep)
+{
+	return udp_send(&udp.peer, udp.peer_len, UDP_ID_FASTBOOT, flags, seq,
+			data, len, keep);
+}
+
+
+static void udp_error(const struct sockaddr_storage *to, socklen_t to_len,
+		uint16_t seq, const char *msg)
+{
+	udp_send(to, to_len, UDP_ID_ERROR, 0, seq, msg, strlen(msg), false);
+}
+
+
+static bool udp_same_peer(const struct sockaddr_storage *from,
+		socklen_t from_len)
+{
+	return udp.active && from_len == udp.peer_len &&
+		!memcmp(from, &udp.peer, from_len);
+}
+
+
+/* Append in-order payload. Fails if there's no room, in which case the
+ * packet is dropped unacknowledged and the host will send it again. */
+static int udp_rx_append(const unsigned char *data, size_t len, uint8_t flags)
+{
+	if (udp.rx_end + len > udp.rx_size && udp.rx_start) {
+		memmove(udp.rx, udp.rx + udp.rx_start,
+				udp.rx_end - udp.rx_start);
+		udp.rx_end -= udp.rx_start;
+		udp.rx_start = 0;
+	}
+	if (udp.rx_end + len > udp.rx_size)
+		return -1;
+
+	memcpy(udp.rx + udp.rx_end, data, len);
+	udp.rx_end += len;
+	if (!(flags & UDP_FLAG_CONTINUATION))
+		udp.rx_msg_done = true;
+	return 0;
+}
+
+
+/* Move packets that arrived early into the stream once the gap in
+ * front of them has been filled. They were acknowledged on arrival. */
+static void udp_drain(void)
+{
+	for (;;) {
+		struct udp_slot *slot = &udp.slots[udp.seq % udp.window];
+
+		if (!slot->used || slot->seq != udp.seq)
+			return;
+		if (udp_rx_append(slot->data, slot->len, slot->flags))
+			return;
+		slot->used = false;
+		udp.seq++;
+	}
+}
+
+
+static void udp_handle_init(const unsigned char *pkt, size_t len,
+		const struct sockaddr_storage *from, socklen_t from_len)
+{
+	uint16_t seq = get_be16(pkt + 2);
+	unsigned char resp[4];
+	unsigned host_max;
+	unsigned i;
+
+	/* Our answer got lost */
+	if (udp_same_peer(from, from_len) && udp.have_last &&
+			udp.last_seq == seq && udp.last[0] == UDP_ID_INIT) {
+		udp_send(from, from_len, UDP_ID_INIT, 0, seq, udp.last +
+				UDP_HEADER_SIZE, udp.last_len - UDP_HEADER_SIZE,
+				false);
+		return;
+	}
+
+	if (len < UDP_HEADER_SIZE + 4 || get_be16(pkt + 4) < UDP_VERSION) {
+		udp_error(from, from_len, seq, "unsupported protocol version");
+		return;
+	}
+	host_max = get_be16(pkt + 6);
+	if (host_max < UDP_MIN_PACKET) {
+		udp_error(from, from_len, seq, "packet size too small");
+		return;
+	}
+
+	if (udp.active && (udp.rx_end != udp.rx_start || udp.poll_pending))
+		udp.reset = true;
+
+	memcpy(&udp.peer, from, from_len);
+	udp.peer_len = from_len;
+	udp.active = true;
+	udp.seq = seq + 1;
+	udp.max_payload = min(host_max, (unsigned)UDP_MAX_PACKET) -
+		UDP_HEADER_SIZE;
+	udp.poll_pending = false;
+	udp.rx_start = udp.rx_end = 0;
+	udp.rx_msg_done = false;
+	for (i = 0; i < udp.window; i++)
+		udp.slots[i].used = false;
+
+	put_be16(resp, UDP_VERSION);
+	put_be16(resp + 2, udp.max_payload + UDP_HEADER_SIZE);
+	udp_send(from, from_len, UDP_ID_INIT, 0, seq, resp, sizeof(resp), true);
+	pr_debug("UDP session started, %zu byte packets\n",
+			udp.max_payload + UDP_HEADER_SIZE);
+}
+
+
+static void udp_handle_fastboot(const unsigned char *pkt, size_t len)
+{
+	uint8_t flags = pkt[1];
+	uint16_t seq = get_be16(pkt + 2);
+	uint16_t ahead = seq - udp.seq;
+	const unsigned char *payload = pkt + UDP_HEADER_SIZE;
+	size_t plen = len - UDP_HEADER_SIZE;
+
+	if (plen > udp.max_payload)
+		return;
+
+	if (ahead == 0) {
+		if (!plen) {
+			/* Host wants data. Answered by the next write. */
+			udp.poll_pending = true;
+			udp.poll_seq = seq;
+			udp.seq++;
+			return;
+		}
+		if (udp_rx_append(payload, plen, flags))
+			return;
+		udp_respond(seq, 0, NULL, 0, true);
+		udp.seq++;
+		udp_drain();
+	} else if (ahead < udp.window) {
+		struct udp_slot *slot = &udp.slots[seq % udp.window];
+
+		/* Only data can be pipelined, polls are strictly in order */
+		if (!plen)
+			return;
+		slot->used = true;
+		slot->seq = seq;
+		slot->flags = flags;
+		slot->len = plen;
+		memcpy(slot->data, payload, plen);
+		udp_respond(seq, 0, NULL, 0, false);
+	} else if (udp.poll_pending && seq == udp.poll_seq) {
+		/* Still working on it */
+	} else if (udp.have_last && seq == udp.last_seq) {
+		sendto(udp.fd, udp.last, udp.last_len, 0,
+				(struct sockaddr *)&udp.peer, udp.peer_len);
+	} else if ((uint16_t)(udp.seq - seq) <= udp.window && plen) {
+		/* Data we already have whose ack got lost */
+		udp_respond(seq, 0, NULL, 0, false);
+	}
+}
+
+
+/* Wait for and process one packet */
+static int udp_wait(void)
+{
+	unsigned char pkt[UDP_MAX_PACKET + 1];
+	struct sockaddr_storage from;
+	socklen_t from_len = sizeof(from);
+	struct pollfd pfd;
+	ssize_t len;
+	uint16_t seq;
+	int r;
+
+	pfd.fd = udp.fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, UDP_IDLE_TIMEOUT_MS);
+	if (r < 0) {
+		if (errno == EINTR)
+			return 0;
+		pr_perror("poll");
+		return -1;
+	} else if (r == 0) {
+		pr_debug("UDP host went quiet\n");
+		return -1;
+	}
+
+	len = recvfrom(udp.fd, pkt, sizeof(pkt), 0,
+			(struct sockaddr *)&from, &from_len);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		pr_perror("recvfrom");
+		return -1;
+	}
+	if (len < UDP_HEADER_SIZE || len > UDP_MAX_PACKET)
+		return 0;
+	seq = get_be16(pkt + 2);
+
+	switch (pkt[0]) {
+	case UDP_ID_QUERY:
+	{
+		unsigned char resp[2];
+
+		/* Tells the host which sequence number to start with */
+		put_be16(resp, udp_same_peer(&from, from_len) ? udp.seq : 0);
+		udp_send(&from, from_len, UDP_ID_QUERY, 0, seq, resp,
+				sizeof(resp), false);
+		break;
+	}
+	case UDP_ID_INIT:
+		udp_handle_init(pkt, len, &from, from_len);
+		break;
+	case UDP_ID_FASTBOOT:
+		if (!udp_same_peer(&from, from_len)) {
+			udp_error(&from, from_len, seq, "no session");
+			break;
+		}
+		udp_handle_fastboot(pkt, len);
+		break;
+	default:
+		udp_error(&from, from_len, seq, "unknown packet type");
+		break;
+	}
+	return 0;
+}
+
+
+int udp_read(void *_buf, unsigned len, bool command)
+{
+	unsigned char *buf = _buf;
+	unsigned count = 0;
+
+	udp.reset = false;
+	for (;;) {
+		size_t avail, n;
+
+		if (udp.reset) {
+			pr_error("UDP session restarted by host\n");
+			udp.reset = false;
+			if (!command)
+				return -1;
+		}
+
+		udp_drain();
+		avail = udp.rx_end - udp.rx_start;
+		if (command) {
+			if (udp.rx_msg_done) {
+				/* A command is always a whole message */
+				n = min((size_t)len, avail);
+				memcpy(buf, udp.rx + udp.rx_start, n);
+				udp.rx_start = udp.rx_end = 0;
+				udp.rx_msg_done = false;
+				return n;
+			}
+		} else {
+			n = min((size_t)(len - count), avail);
+			memcpy(buf + count, udp.rx + udp.rx_start, n);
+			udp.rx_start += n;
+			count += n;
+			if (udp.rx_start == udp.rx_end) {
+				udp.rx_start = udp.rx_end = 0;
+				udp.rx_msg_done = false;
+			}
+			if (count == len)
+				return count;
+		}
+
+		if (udp_wait())
+			return -1;
+	}
+}
+
+
+int udp_write(const void *_buf, unsigned len)
+{
+	const unsigned char *buf = _buf;
+	unsigned pos = 0;
+
+	udp.reset = false;
+	while (pos < len) {
+		size_t n;
+
+		if (udp.reset) {
+			pr_error("UDP session restarted by host\n");
+			udp.reset = false;
+			return -1;
+		}
+		if (!udp.poll_pending) {
+			if (udp_wait())
+				return -1;
+			continue;
+		}
+
+		/* The rest goes out as the host keeps asking */
+		n = min((size_t)(len - pos), udp.max_payload);
+		if (udp_respond(udp.poll_seq, pos + n < len ?
+				UDP_FLAG_CONTINUATION : 0, buf + pos, n, true))
+			return -1;
+		udp.poll_pending = false;
+		pos += n;
+	}
+	return len;
+}
+
+
+static int udp_bind(int family)
+{
+	int fd;
+	int off = 0;
+	int bufsize = UDP_SOCK_BUF;
+	struct sockaddr_storage ss;
+	socklen_t len;
+
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(UDP_PORT);
+		len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(UDP_PORT);
+		len = sizeof(*sin);
+	}
+
+	/* Room for a full window from a pipelining host */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0) {
+		pr_error("UDP bind failure: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int udp_open(void)
+{
+	char val[PROPERTY_VALUE_MAX];
+
+	if (udp.fd >= 0)
+		return udp.fd;
+
+	if (!udp.slots) {
+		property_get(UDP_WINDOW_PROP, val, "");
+		udp.window = val[0] ? strtoul(val, NULL, 0) : UDP_DEFAULT_WINDOW;
+		udp.window = max(1U, min(udp.window, (unsigned)UDP_MAX_WINDOW));
+		udp.slots = xmalloc(udp.window * sizeof(*udp.slots));
+		memset(udp.slots, 0, udp.window * sizeof(*udp.slots));
+		udp.rx_size = (udp.window + 1) * UDP_MAX_PACKET;
+		udp.rx = xmalloc(udp.rx_size);
+		fastboot_publish("udp-window", xasprintf("%u", udp.window));
+	}
+
+	udp.fd = udp_bind(AF_INET6);
+	if (udp.fd < 0)
+		udp.fd = udp_bind(AF_INET);
+	if (udp.fd < 0) {
+		pr_error("Couldn't listen on UDP port %d\n", UDP_PORT);
+		return -1;
+	}
+
+	pr_info("Listening on UDP port %d\n", UDP_PORT);
+	return udp.fd;
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_UDP_H_
+#define _USERFASTBOOT_UDP_H_
+
+#include <stdbool.h>
+
+/* Fastboot over UDP, following the AOSP protocol. Host packets are
+ * answered one for one with matching sequence numbers, and the device
+ * only sends data in response to host packets. */
+
+/* Returns the socket to poll for the start of a session */
+int udp_open(void);
+
+/* Same semantics as the other transports. In command mode a single
+ * host message is returned; otherwise exactly len bytes are read. Both
+ * return -1 when the host has gone quiet for a while, the session state
+ * is kept so the host can carry on later. */
+int udp_read(void *buf, unsigned len, bool command);
+int udp_write(const void *buf, unsigned len);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -20,6 +20,7 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -81,14 +82,33 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static double gProgressScopeTime, gProgressScopeDuration;
 
-// Set to 1 when both graphics pages are the same (except for the progress bar)
-static int gPagesIdentical = 0;
+// Progress as reported by the threads doing the work, scaled by
+// PROGRESS_SCALE. They only ever store it; progress_thread picks it up
+// and does all of the drawing, so I/O loops never wait on the screen.
+#define PROGRESS_SCALE 65536
+static int gProgressReported = 0;
+
+// Parts of the screen that changed since the last frame. Other threads
+// only mark damage; progress_thread repaints just those parts and only
+// flips when there was any.
+#define DAMAGE_STATUS	(1 << 0)
+#define DAMAGE_PROGRESS	(1 << 1)	// progress bar and install overlay
+#define DAMAGE_INFO	(1 << 2)	// infotext in the top-left corner
+#define DAMAGE_ROWS	(1 << 3)	// text or menu rows in gDamageRows
+#define DAMAGE_ALL	(1 << 4)
+static int gDamage = 0;
+static uint64_t gDamageRows = 0;	// one bit per screen row
+
+// What was repainted on the last frame. The other page doesn't have it
+// yet, so it gets repainted again on the next one.
+static int gLastDamage = 0;
+static uint64_t gLastDamageRows = 0;
 
 static char text[MAX_ROWS][MAX_COLS];
 static char status[MAX_COLS];
 static char infotext[MAX_ROWS][MAX_COLS];
 static int info_row = 0;
-static int status_modified = 0;
+static int info_rows_max = 0;	// rows of infotext that may be on screen
 static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 0;
@@ -112,6 +132,42 @@ static double now()
 	return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
+static void damage(int what)
+{
+	__atomic_or_fetch(&gDamage, what, __ATOMIC_RELEASE);
+}
+
+static void damage_rows(uint64_t rows)
+{
+	__atomic_or_fetch(&gDamageRows, rows, __ATOMIC_RELEASE);
+	damage(DAMAGE_ROWS);
+}
+
+static uint64_t all_rows(void)
+{
+	return text_rows >= 64 ? ~0ULL : (1ULL << text_rows) - 1;
+}
+
+// Blit the part of a surface placed at (x, y) that falls within the
+// rectangle (x1, y1)-(x2, y2).
+static void blit_clipped(gr_surface surface, int x, int y,
+			 int x1, int y1, int x2, int y2)
+{
+	int w = gr_get_width(surface);
+	int h = gr_get_height(surface);
+
+	if (x1 < x)
+		x1 = x;
+	if (y1 < y)
+		y1 = y;
+	if (x2 > x + w)
+		x2 = x + w;
+	if (y2 > y + h)
+		y2 = y + h;
+	if (x1 < x2 && y1 < y2)
+		gr_blit(surface, x1 - x, y1 - y, x2 - x1, y2 - y1, x1, y1);
+}
+
 // Draw the given frame over the installation overlay animation.  The
 // background is not cleared or draw with the base icon first; we
 // assume that the frame already contains some other frame of the
@@ -129,15 +185,49 @@ static void draw_install_overlay_locked(int frame)
 		ui_parameters.install_overlay_offset_y);
 }
 
+// Draw whatever of the background icon and its overlay falls within a
+// rectangle, over what is already there.
+// Should only be called with gUpdateMutex locked.
+static void draw_icon_rect_locked(int icon, int x1, int y1, int x2, int y2)
+{
+	if (!icon)
+		return;
+
+	gr_surface surface = gBackgroundIcon[icon];
+	blit_clipped(surface, (gr_fb_width() - gr_get_width(surface)) / 2,
+		     (gr_fb_height() - gr_get_height(surface)) / 2,
+		     x1, y1, x2, y2);
+	if (icon == BACKGROUND_ICON_INSTALLING && gInstallationOverlay)
+		blit_clipped(gInstallationOverlay[gInstallingFrame],
+			     ui_parameters.install_overlay_offset_x,
+			     ui_parameters.install_overlay_offset_y,
+			     x1, y1, x2, y2);
+}
+
+// Draw the infotext in the top-left corner, clearing what was there.
+// Should only be called with gUpdateMutex locked.
+static void draw_info_locked(void)
+{
+	int i;
+
+	pthread_mutex_lock(&gTextMutex);
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, 0, gr_fb_width(), (info_rows_max + 1) * CHAR_HEIGHT);
+	gr_color(167, 162, 195, 255);
+	for (i = 0; i <= info_row; i++)
+		gr_text(0, CHAR_HEIGHT * i, infotext[i], 0);
+	draw_icon_rect_locked(gCurrentIcon, 0, 0, gr_fb_width(),
+			      (info_rows_max + 1) * CHAR_HEIGHT);
+	pthread_mutex_unlock(&gTextMutex);
+}
+
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(int icon)
 {
 	int i;
-	gPagesIdentical = 0;
 	gr_color(0, 0, 0, 255);
 	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
-	status_modified = 1;
 
 	if (!show_text && !show_menu) {
 		gr_color(167, 162, 195, 255);
@@ -160,6 +250,7 @@ static void draw_background_locked(int icon)
 	}
 }
 
+// Should only be called with gUpdateMutex locked.
 static void draw_status_locked()
 {
 	int iconHeight =
@@ -171,22 +262,17 @@ static void draw_status_locked()
 
 	pthread_mutex_lock(&gTextMutex);
 
-	if (status_modified) {
-		int textwidth = gr_measure(status);
-		int dx = (gr_fb_width() - textwidth) / 2;
-		/* We want the text just below the progress bar */
-		int dy =
-		    CHAR_HEIGHT + height + (3 * gr_fb_height() +
-					    iconHeight) / 4;
+	int textwidth = gr_measure(status);
+	int dx = (gr_fb_width() - textwidth) / 2;
+	/* We want the text just below the progress bar */
+	int dy = CHAR_HEIGHT + height + (3 * gr_fb_height() + iconHeight) / 4;
 
-		/* Clear any old text in the area */
-		gr_color(0, 0, 0, 255);
-		gr_fill(0, dy - CHAR_HEIGHT, gr_fb_width(), dy + CHAR_HEIGHT);
+	/* Clear any old text in the area */
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, dy - CHAR_HEIGHT, gr_fb_width(), dy + CHAR_HEIGHT);
 
-		gr_color(187, 221, 230, 255);
-		gr_text(dx, dy, status, 1);
-		status_modified = 0;
-	}
+	gr_color(187, 221, 230, 255);
+	gr_text(dx, dy, status, 1);
 
 	pthread_mutex_unlock(&gTextMutex);
 }
@@ -195,8 +281,6 @@ static void draw_status_locked()
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
-	draw_status_locked();
-
 	if (gCurrentIcon == BACKGROUND_ICON_INSTALLING) {
 		draw_install_overlay_locked(gInstallingFrame);
 	}
@@ -247,6 +331,40 @@ static void draw_text_line(int row, const char *t)
 	}
 }
 
+// Draw one row of the text log or the menu, with the dimmed background
+// behind it. Nothing outside the row is touched, so the line the menu
+// highlight reaches into the next row is left to the caller.
+// Should only be called with gUpdateMutex locked.
+static void draw_row_locked(int row)
+{
+	int y1 = row * CHAR_HEIGHT, y2 = y1 + CHAR_HEIGHT;
+
+	gr_color(0, 0, 0, 255);
+	gr_fill(0, y1, gr_fb_width(), y2);
+	draw_icon_rect_locked(gCurrentIcon, 0, y1, gr_fb_width(), y2);
+	gr_color(0, 0, 0, 160);
+	gr_fill(0, y1, gr_fb_width(), y2);
+
+	if (show_menu) {
+		gr_color(64, 96, 255, 255);
+		if (row == menu_top + menu_items)
+			gr_fill(0, y1 + CHAR_HEIGHT / 2 - 1,
+				gr_fb_width(), y1 + CHAR_HEIGHT / 2 + 1);
+		if (row >= menu_top + menu_items)
+			return;
+		if (row == menu_top + menu_sel) {
+			gr_fill(0, y1, gr_fb_width(), y2);
+			gr_color(255, 255, 255, 255);
+		}
+		draw_text_line(row, menu[row]);
+	} else {
+		gr_color(255, 255, 255, 255);
+		pthread_mutex_lock(&gTextMutex);
+		draw_text_line(row, text[(row + text_top) % text_rows]);
+		pthread_mutex_unlock(&gTextMutex);
+	}
+}
+
 // Redraw everything on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_screen_locked(void)
@@ -286,41 +404,67 @@ static void draw_screen_locked(void)
 		}
 		pthread_mutex_unlock(&gTextMutex);
 	} else {
+		draw_status_locked();
 		draw_progress_locked();
 	}
 }
 
-// Redraw everything on the screen and flip the screen (make it visible).
+// Repaint the damaged parts of the screen and flip, if anything that is
+// visible right now changed.
 // Should only be called with gUpdateMutex locked.
-static void update_screen_locked(void)
+static void update_screen_locked(int what, uint64_t rows)
 {
-	draw_screen_locked();
-	gr_flip();
-}
+	int i;
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
-// Should only be called with gUpdateMutex locked.
-static void update_progress_locked(void)
-{
-	if (show_text || show_menu)
+	// Only some parts exist in each mode
+	if (show_text || show_menu) {
+		what &= DAMAGE_ALL | DAMAGE_ROWS;
+		rows &= all_rows();
+		if (!rows)
+			what &= ~DAMAGE_ROWS;
+	} else {
+		what &= ~DAMAGE_ROWS;
+		rows = 0;
+	}
+	if (!what)
 		return;
 
-	if (!gPagesIdentical) {
-		draw_screen_locked();	// Must redraw the whole screen
-		gPagesIdentical = 1;
+	// The other page still lacks what changed on the last frame
+	int all = what | gLastDamage;
+	uint64_t all_rows_damaged = rows | gLastDamageRows;
+
+	if (all & DAMAGE_ALL) {
+		draw_screen_locked();
+	} else if (show_text || show_menu) {
+		for (i = 0; i < text_rows; i++)
+			if (all_rows_damaged & (1ULL << i))
+				draw_row_locked(i);
+
+		// The highlight's bottom line lies in the row below, whose
+		// repaint may just have covered it
+		i = menu_top + menu_sel;
+		if (show_menu && (all_rows_damaged & (3ULL << i))) {
+			gr_color(64, 96, 255, 255);
+			gr_fill(0, (i + 1) * CHAR_HEIGHT,
+				gr_fb_width(), (i + 1) * CHAR_HEIGHT + 1);
+		}
 	} else {
-		draw_progress_locked();	// Draw only the progress bar and overlays
+		if (all & DAMAGE_INFO)
+			draw_info_locked();
+		if (all & DAMAGE_STATUS)
+			draw_status_locked();
+		if (all & DAMAGE_PROGRESS)
+			draw_progress_locked();
 	}
 	gr_flip();
-}
 
-static void update_status_locked(void)
-{
-	draw_status_locked();
-	gr_flip();
+	gLastDamage = what;
+	gLastDamageRows = rows;
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
+// All of the drawing happens here, at most update_fps times a second
+// however often things change.
 static void *progress_thread(void *cookie)
 {
 	double interval = 1.0 / ui_parameters.update_fps;
@@ -328,7 +472,23 @@ static void *progress_thread(void *cookie)
 		double start = now();
 		pthread_mutex_lock(&gUpdateMutex);
 
-		int redraw = 0;
+		int what = __atomic_exchange_n(&gDamage, 0, __ATOMIC_ACQUIRE);
+		uint64_t rows = __atomic_exchange_n(&gDamageRows, 0,
+						    __ATOMIC_ACQUIRE);
+
+		// pick up reported progress, skipping updates that aren't
+		// visibly different
+		float fraction = (float)__atomic_load_n(&gProgressReported,
+						__ATOMIC_RELAXED) / PROGRESS_SCALE;
+		if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+		    fraction > gProgress) {
+			int width = gr_get_width(gProgressBarIndeterminate[0]);
+			float scale = width * gProgressScopeSize;
+			if ((int)(gProgress * scale) != (int)(fraction * scale)) {
+				gProgress = fraction;
+				what |= DAMAGE_PROGRESS;
+			}
+		}
 
 		// update the installation animation, if active
 		if (gCurrentIcon == BACKGROUND_ICON_INSTALLING &&
@@ -337,12 +497,12 @@ static void *progress_thread(void *cookie)
 			gInstallingFrame =
 			    (gInstallingFrame +
 			     1) % ui_parameters.installing_frames;
-			redraw = 1;
+			what |= DAMAGE_PROGRESS;
 		}
 		// update the progress bar animation, if active
 		if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE &&
 		    !show_text && !show_menu) {
-			redraw = 1;
+			what |= DAMAGE_PROGRESS;
 		}
 		// move the progress bar forward on timed intervals, if configured
 		int duration = gProgressScopeDuration;
@@ -353,12 +513,11 @@ static void *progress_thread(void *cookie)
 				progress = 1.0;
 			if (progress > gProgress) {
 				gProgress = progress;
-				redraw = 1;
+				what |= DAMAGE_PROGRESS;
 			}
 		}
 
-		if (redraw)
-			update_progress_locked();
+		update_screen_locked(what, rows);
 
 		pthread_mutex_unlock(&gUpdateMutex);
 		double end = now();
@@ -530,7 +689,7 @@ void mui_set_background(int icon)
 
 	pthread_mutex_lock(&gUpdateMutex);
 	gCurrentIcon = icon;
-	update_screen_locked();
+	damage(DAMAGE_ALL);
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -542,7 +701,7 @@ void mui_show_indeterminate_progress()
 	pthread_mutex_lock(&gUpdateMutex);
 	if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
 		gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
-		update_progress_locked();
+		damage(DAMAGE_PROGRESS);
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -559,30 +718,23 @@ void mui_show_progress(float portion, int seconds)
 	gProgressScopeTime = now();
 	gProgressScopeDuration = seconds;
 	gProgress = 0;
-	update_progress_locked();
+	__atomic_store_n(&gProgressReported, 0, __ATOMIC_RELAXED);
+	damage(DAMAGE_PROGRESS);
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
+// Called from I/O loops as often as they like: only stores the value
 void mui_set_progress(float fraction)
 {
 	if (!gInit)
 		return;
 
-	pthread_mutex_lock(&gUpdateMutex);
 	if (fraction < 0.0)
 		fraction = 0.0;
 	if (fraction > 1.0)
 		fraction = 1.0;
-	if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
-		// Skip updates that aren't visibly different.
-		int width = gr_get_width(gProgressBarIndeterminate[0]);
-		float scale = width * gProgressScopeSize;
-		if ((int)(gProgress * scale) != (int)(fraction * scale)) {
-			gProgress = fraction;
-			update_progress_locked();
-		}
-	}
-	pthread_mutex_unlock(&gUpdateMutex);
+	__atomic_store_n(&gProgressReported, (int)(fraction * PROGRESS_SCALE),
+			 __ATOMIC_RELAXED);
 }
 
 void mui_reset_progress()
@@ -595,7 +747,8 @@ void mui_reset_progress()
 	gProgressScopeStart = gProgressScopeSize = 0;
 	gProgressScopeTime = gProgressScopeDuration = 0;
 	gProgress = 0;
-	update_screen_locked();
+	__atomic_store_n(&gProgressReported, 0, __ATOMIC_RELAXED);
+	damage(DAMAGE_ALL);
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -630,14 +783,10 @@ void mui_status(const char *fmt, ...)
 	pthread_mutex_lock(&gTextMutex);
 	strncpy(status, buf, sizeof(status));
 	status[sizeof(status) - 1] = '\0';
-	status_modified = 1;
 	pthread_mutex_unlock(&gTextMutex);
 
-	if (!show_text && !show_menu) {
-		pthread_mutex_lock(&gUpdateMutex);
-		update_status_locked();
-		pthread_mutex_unlock(&gUpdateMutex);
-	}
+	// Drawn with the next frame, like progress
+	damage(DAMAGE_STATUS);
 }
 
 void mui_infotext(const char *infodata)
@@ -663,18 +812,20 @@ void mui_infotext(const char *infodata)
 		strncpy(infotext[info_row], token, MAX_COLS);
 		infotext[info_row][MAX_COLS - 1] = '\0';
 	}
+	if (info_row > info_rows_max)
+		info_rows_max = info_row;
 	pthread_mutex_unlock(&gTextMutex);
 	free(idata);
 
-	pthread_mutex_lock(&gUpdateMutex);
-	update_screen_locked();
-	pthread_mutex_unlock(&gUpdateMutex);
+	damage(DAMAGE_INFO);
 }
 
 void mui_print(const char *fmt, ...)
 {
 	char buf[256];
 	va_list ap;
+	uint64_t written = 0, rows = 0;
+	int i;
 
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
@@ -687,6 +838,7 @@ void mui_print(const char *fmt, ...)
 	pthread_mutex_lock(&gTextMutex);
 	if (text_rows > 0 && text_cols > 0) {
 		char *ptr;
+		int top = text_top;
 		if (text_col != 0) {
 			text_col = 0;
 			text_row = (text_row + 1) % text_rows;
@@ -696,6 +848,7 @@ void mui_print(const char *fmt, ...)
 		for (ptr = buf; *ptr != '\0'; ++ptr) {
 			if (*ptr == '\n' || text_col >= text_cols) {
 				text[text_row][text_col] = '\0';
+				written |= 1ULL << text_row;
 				text_col = 0;
 				text_row = (text_row + 1) % text_rows;
 				if (text_row == text_top)
@@ -705,13 +858,20 @@ void mui_print(const char *fmt, ...)
 				text[text_row][text_col++] = *ptr;
 		}
 		text[text_row][text_col] = '\0';
+		written |= 1ULL << text_row;
+
+		// Scrolling moves every row on the screen
+		if (text_top != top)
+			rows = all_rows();
+		else
+			for (i = 0; i < text_rows; i++)
+				if (written & (1ULL << i))
+					rows |= 1ULL << ((i - text_top +
+							  text_rows) % text_rows);
 	}
 	pthread_mutex_unlock(&gTextMutex);
-	if (show_text) {
-		pthread_mutex_lock(&gUpdateMutex);
-		update_screen_locked();
-		pthread_mutex_unlock(&gUpdateMutex);
-	}
+	if (rows)
+		damage_rows(rows);
 
 }
 
@@ -740,7 +900,7 @@ int mui_start_menu(char **headers, char **items, int initial_selection)
 		menu_items = i - menu_top;
 		show_menu = 1;
 		menu_sel = initial_selection;
-		update_screen_locked();
+		damage(DAMAGE_ALL);
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
 	return 0;
@@ -762,7 +922,8 @@ int mui_menu_select(int sel)
 			menu_sel = 0;
 		sel = menu_sel;
 		if (menu_sel != old_sel)
-			update_screen_locked();
+			damage_rows(1ULL << (menu_top + old_sel) |
+				    1ULL << (menu_top + menu_sel));
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
 	return sel;
@@ -776,7 +937,7 @@ void mui_end_menu()
 	pthread_mutex_lock(&gUpdateMutex);
 	if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
 		show_menu = 0;
-		update_screen_locked();
+		damage(DAMAGE_ALL);
 	}
 	pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -795,7 +956,7 @@ void mui_show_text(int visible)
 		return;
 	pthread_mutex_lock(&gUpdateMutex);
 	show_text = visible;
-	update_screen_locked();
+	damage(DAMAGE_ALL);
 	pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aio_syscalls.h"
+#include "usb_aio.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+struct usb_aio {
+	aio_context_t ctx;
+	unsigned depth;
+	size_t req_size;
+
+	struct iocb *iocbs;
+	struct iocb **pending;
+	struct io_event *events;
+	long long *res;
+	bool *done;
+};
+
+
+struct usb_aio *usb_aio_create(unsigned depth, size_t req_size)
+{
+	struct usb_aio *aio;
+
+	aio = xmalloc(sizeof(*aio));
+	memset(aio, 0, sizeof(*aio));
+	if (io_setup(depth, &aio->ctx)) {
+		pr_debug("io_setup: %s\n", strerror(errno));
+		free(aio);
+		return NULL;
+	}
+
+	aio->depth = depth;
+	aio->req_size = req_size;
+	aio->iocbs = xmalloc(depth * sizeof(*aio->iocbs));
+	aio->pending = xmalloc(depth * sizeof(*aio->pending));
+	aio->events = xmalloc(depth * sizeof(*aio->events));
+	aio->res = xmalloc(depth * sizeof(*aio->res));
+	aio->done = xmalloc(depth * sizeof(*aio->done));
+	return aio;
+}
+
+
+void usb_aio_destroy(struct usb_aio *aio)
+{
+	if (!aio)
+		return;
+
+	io_destroy(aio->ctx);
+	free(aio->iocbs);
+	free(aio->pending);
+	free(aio->events);
+	free(aio->res);
+	free(aio->done);
+	free(aio);
+}
+
+
+/* io_destroy() cancels or waits out everything still in flight, which
+ * is the only reliable way to get the buffers back after an error */
+static void usb_aio_cancel(struct usb_aio *aio)
+{
+	io_destroy(aio->ctx);
+	aio->ctx = 0;
+	if (io_setup(aio->depth, &aio->ctx))
+		pr_perror("io_setup");
+}
+
+
+static ssize_t usb_aio_xfer(struct usb_aio *aio, int fd, unsigned char *buf,
+		size_t len, int opcode)
+{
+	size_t filled = 0;	/* contiguous bytes done at the start of buf */
+	size_t queued = 0;	/* end of the area covered by requests */
+	unsigned head = 0;
+	unsigned inflight = 0;
+	bool short_read = false;
+
+	while (filled < len) {
+		unsigned nr = 0;
+		int i, r;
+
+		/* A short read leaves a hole in front of the requests that
+		 * were queued behind it. Let those drain and get compacted
+		 * before queuing anything new. */
+		if (short_read && !inflight) {
+			short_read = false;
+			queued = filled;
+		}
+
+		while (!short_read && inflight + nr < aio->depth &&
+				queued < len) {
+			unsigned slot = (head + inflight + nr) % aio->depth;
+			struct iocb *cb = &aio->iocbs[slot];
+			size_t n = min(aio->req_size, len - queued);
+
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_data = slot;
+			cb->aio_lio_opcode = opcode;
+			cb->aio_fildes = fd;
+			cb->aio_buf = (uintptr_t)(buf + queued);
+			cb->aio_nbytes = n;
+			aio->done[slot] = false;
+			aio->pending[nr++] = cb;
+			queued += n;
+		}
+
+		if (nr) {
+			r = io_submit(aio->ctx, nr, aio->pending);
+			if (r < 0) {
+				pr_perror("io_submit");
+				goto err;
+			}
+			/* Partial submission; the rest go out next time */
+			for (i = r; i < (int)nr; i++)
+				queued -= aio->pending[i]->aio_nbytes;
+			inflight += r;
+		}
+
+		r = io_getevents(aio->ctx, 1, aio->depth, aio->events, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("io_getevents");
+			goto err;
+		}
+		for (i = 0; i < r; i++) {
+			unsigned slot = aio->events[i].data;
+
+			aio->res[slot] = aio->events[i].res;
+			aio->done[slot] = true;
+		}
+
+		/* Requests on an endpoint complete in order, but retire
+		 * them in submission order regardless */
+		while (inflight && aio->done[head]) {
+			struct iocb *cb = &aio->iocbs[head];
+			size_t offset = (unsigned char *)(uintptr_t)cb->aio_buf - buf;
+			long long res = aio->res[head];
+
+			if (res < 0) {
+				pr_error("usb aio: %s\n", strerror(-res));
+				goto err;
+			} else if (res == 0) {
+				pr_debug("Connection closed\n");
+				goto err;
+			}
+
+			if (offset != filled)
+				memmove(buf + filled, buf + offset, res);
+			filled += res;
+
+			if ((size_t)res < cb->aio_nbytes) {
+				if (opcode != IOCB_CMD_PREAD) {
+					pr_error("usb aio: short write\n");
+					goto err;
+				}
+				short_read = true;
+			}
+			head = (head + 1) % aio->depth;
+			inflight--;
+		}
+	}
+	return filled;
+
+err:
+	usb_aio_cancel(aio);
+	return -1;
+}
+
+
+ssize_t usb_aio_read(struct usb_aio *aio, int fd, void *buf, size_t len)
+{
+	return usb_aio_xfer(aio, fd, buf, len, IOCB_CMD_PREAD);
+}
+
+
+ssize_t usb_aio_write(struct usb_aio *aio, int fd, const void *buf, size_t len)
+{
+	return usb_aio_xfer(aio, fd, (unsigned char *)buf, len,
+			IOCB_CMD_PWRITE);
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USERFASTBOOT_USB_AIO_H_
+#define _USERFASTBOOT_USB_AIO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Keeps up to depth requests of req_size bytes queued on a FunctionFS
+ * endpoint using Linux AIO, instead of one 4K synchronous transfer at a
+ * time. Returns NULL if the kernel doesn't support AIO. */
+struct usb_aio;
+
+struct usb_aio *usb_aio_create(unsigned depth, size_t req_size);
+void usb_aio_destroy(struct usb_aio *aio);
+
+/* Transfer exactly len bytes. Requests never extend past len, so we
+ * can't end up waiting on data the host isn't going to send. Returns
+ * len or -1 on error, in which case outstanding requests are cancelled. */
+ssize_t usb_aio_read(struct usb_aio *aio, int fd, void *buf, size_t len);
+ssize_t usb_aio_write(struct usb_aio *aio, int fd, const void *buf, size_t len);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
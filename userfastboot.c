@@ -41,7 +41,6 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
-#include <sys/statfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mount.h>
@@ -67,8 +66,6 @@ struct selabel_handle *sehandle;
 
 int main(int argc, char **argv)
 {
-	struct statfs buf;
-	int ret = 0;
 	/* Files written only read/writable by root */
 	umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
@@ -96,14 +93,7 @@ int main(int argc, char **argv)
 		pr_error("Warning: No file_contexts\n");
 	}
 
-	ret = statfs("/tmp", &buf);
-	if (!ret) {
-		unsigned long size = buf.f_bsize * buf.f_bfree;
-		fastboot_init(size);
-	} else {
-		pr_error("Error when acquiring tmpfs size:-%d\n", errno);
-		exit(1);
-	}
+	fastboot_init();
 
 	load_volume_table();
 	aboot_register_commands();
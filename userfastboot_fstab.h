@@ -20,6 +20,8 @@
 #include <stdbool.h>
 #include <fs_mgr.h>
 
+#include "erase.h"
+
 // Load and parse volume data from /etc/recovery.fstab.
 void load_volume_table();
 
@@ -29,6 +31,10 @@ struct fstab_rec* volume_for_path(const char* path);
 // Return struct fstab_rec* record for named entry (minus the leading '/')
 struct fstab_rec *volume_for_name(const char *name);
 
+// How to erase the volume, from an erase=secure|discard|headers|zero
+// option among its fs_mgr flags. Secure if there is none.
+enum erase_policy volume_erase_policy(struct fstab_rec *vol);
+
 // publish all the types and sizes of known partitions
 // if wait is true, wait for device nodes to show up
 void publish_all_part_data(bool wait);
@@ -19,6 +19,7 @@
 
 #include <userfastboot_ui.h>
 #include <cutils/hashmap.h>
+#include <data_window.h>
 
 enum device_state {
 	LOCKED = 0,
@@ -28,6 +29,11 @@ enum device_state {
 
 typedef int (*flash_func)(Hashmap *params, int fd, void *data, unsigned sz);
 
+/* Flash handlers that read the download through dw a window at a time
+ * instead of getting all of it mapped, for images that might not fit
+ * in the address space */
+typedef int (*flash_window_func)(Hashmap *params, struct data_window *dw);
+
 #define MAX_OEM_ARGS 64
 
 typedef int (*oem_func)(int argc, char **argv);
@@ -35,9 +41,18 @@ typedef int (*oem_func)(int argc, char **argv);
 int aboot_register_flash_cmd(char *key, flash_func callback,
 		enum device_state min_state);
 
+int aboot_register_flash_window_cmd(char *key, flash_window_func callback,
+		enum device_state min_state);
+
 int aboot_register_oem_cmd(char *key, oem_func callback,
 		enum device_state min_state);
 
+/* For OEM commands that only report information. They run without
+ * holding the action lock, concurrently with commands from other
+ * sessions, so they must not touch the disks or change device state. */
+int aboot_register_oem_query(char *key, oem_func callback,
+		enum device_state min_state);
+
 /* Takes ownership of the value pointer, may be freed at any time. Do not
  * use a constant string! xstrdup() is your friend.
  * It uses a copy of the name pointer, can be a constant string or something
@@ -2,14 +2,25 @@
 #define USERFASTBOOT_UTIL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <diskconfig/diskconfig.h>
 #include "userfastboot_fstab.h"
+#include "data_window.h"
 
 /* File I/O */
 int named_file_write(const char *filename, const unsigned char *what,
 		size_t sz, off_t offset, int append);
-int named_file_write_ext4_sparse(const char *filename, const char *what);
+
+/* Flags for writing images to partitions */
+#define IMAGE_DISCARD	(1 << 0)	/* discard DONT_CARE areas */
+#define IMAGE_DELTA	(1 << 1)	/* only write blocks that changed */
+#define IMAGE_VERIFY	(1 << 2)	/* read back and check while writing */
+
+int named_file_write_image(const char *filename, struct data_window *dw,
+		uint64_t vsize, unsigned flags);
+int named_file_write_decompress(const char *filename, struct data_window *dw,
+		uint64_t vsize, unsigned flags);
 
 /* Attribute specification and -Werror prevents most security shenanigans with
  * these functions */
@@ -42,6 +53,7 @@ void xstring_append_line(char **str, const char *fmt, ...) __attribute__ ((forma
 /* struct fstab_rec operations */
 int mount_partition(struct fstab_rec *vol, bool readonly);
 int erase_partition(struct fstab_rec *vol);
+int wipe_partition(struct fstab_rec *vol);
 int check_ext_superblock(struct fstab_rec *vol, int *sb_present);
 int unmount_partition(struct fstab_rec *vol);
 int get_volume_size(struct fstab_rec *vol, uint64_t *sz);
@@ -47,23 +47,14 @@
 #include <cutils/android_reboot.h>
 #include <bootloader.h>
 
-#include <sparse/sparse.h>
-#include "sparse_file.h"
-#include "output_file.h"
-#include "backed_block.h"
-#include "sparse_defs.h"
-#include "sparse_format.h"
-
 #include "fastboot.h"
 #include "userfastboot.h"
 #include "userfastboot_ui.h"
 #include "userfastboot_util.h"
 #include "userfastboot_fstab.h"
-
-/* make_ext4fs.h can't be included along with linux/ext3_fs.h.
- * This is the only item needed out of the former. */
-extern int make_ext4fs(const char *filename, int64_t len,
-		const char *mountpoint, struct selabel_handle *sehnd);
+#include "image_writer.h"
+#include "decompress.h"
+#include "erase.h"
 
 void die(void)
 {
@@ -161,142 +152,101 @@ ssize_t robust_write(int fd, const void *buf, size_t count)
 }
 
 
-static void sparse_file_write_block(struct output_file *out,
-		struct backed_block *bb)
+static int setup_image_writer(struct image_writer *iw, const char *filename,
+		unsigned flags)
 {
-	switch (backed_block_type(bb)) {
-	case BACKED_BLOCK_DATA:
-		write_data_chunk(out, backed_block_len(bb), backed_block_data(bb));
-		break;
-	case BACKED_BLOCK_FILE:
-		write_file_chunk(out, backed_block_len(bb),
-				backed_block_filename(bb), backed_block_file_offset(bb));
-		break;
-	case BACKED_BLOCK_FD:
-		write_fd_chunk(out, backed_block_len(bb),
-				backed_block_fd(bb), backed_block_file_offset(bb));
-		break;
-	case BACKED_BLOCK_FILL:
-		write_fill_chunk(out, backed_block_len(bb),
-				backed_block_fill_val(bb));
-		break;
+	iw->discard = flags & IMAGE_DISCARD;
+	if ((flags & IMAGE_DELTA) && image_writer_set_delta(iw, filename))
+		return -1;
+	if ((flags & IMAGE_VERIFY) && image_writer_set_verify(iw, filename)) {
+		image_writer_abort(iw);
+		return -1;
 	}
+	return 0;
 }
 
-static unsigned int sparse_count_chunks(struct sparse_file *s)
-{
-	struct backed_block *bb;
-	unsigned int last_block = 0;
-	unsigned int chunks = 0;
 
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb)) {
-		if (backed_block_block(bb) > last_block) {
-			/* If there is a gap between chunks, add a skip chunk */
-			chunks++;
-		}
-		chunks++;
-		last_block = backed_block_block(bb) +
-				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
-	}
-	if (last_block < DIV_ROUND_UP(s->len, s->block_size)) {
-		chunks++;
-	}
-
-	return chunks;
-}
+/* Images are fed to the writer in pieces, just so there's progress to
+ * show */
+#define IMAGE_WRITE_PIECE	(16 * 1024 * 1024)
 
-static int write_all_blocks(struct sparse_file *s, struct output_file *out)
+/* Write a raw or sparse image to the block device filename in a
+ * single pass */
+int named_file_write_image(const char *filename, struct data_window *dw,
+		uint64_t vsize, unsigned flags)
 {
-	struct backed_block *bb;
-	unsigned int last_block = 0;
-	int64_t pad;
-	unsigned int total_blocks = 0;
-	unsigned int count = 0;
+	struct image_writer iw;
+	struct blkwriter *bw;
+	uint64_t sz = dw->size;
+	uint64_t done = 0;
+	int ret = 0;
+
+	bw = blkwriter_open(filename);
+	if (!bw)
+		return -1;
 
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb))
-		total_blocks++;
+	image_writer_init(&iw, bw, vsize);
+	iw.size = sz;
+	if (setup_image_writer(&iw, filename, flags)) {
+		blkwriter_close(bw);
+		return -1;
+	}
 
 	mui_show_progress(1.0, 0);
+	while (done < sz) {
+		size_t n = min(sz - done, (uint64_t)IMAGE_WRITE_PIECE);
+		const void *pos = data_window_map(dw, done, n);
 
-	for (bb = backed_block_iter_new(s->backed_block_list); bb;
-			bb = backed_block_iter_next(bb)) {
-		mui_set_progress((float)count / (float)total_blocks);
-		if (backed_block_block(bb) > last_block) {
-			unsigned int blocks = backed_block_block(bb) - last_block;
-			write_skip_chunk(out, (int64_t)blocks * s->block_size);
-		}
-		sparse_file_write_block(out, bb);
-		last_block = backed_block_block(bb) +
-				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
-		count++;
+		ret = pos ? image_writer_write(&iw, pos, n) : -1;
+		if (ret)
+			break;
+		done += n;
+		mui_set_progress((float)done / (float)sz);
 	}
-
 	mui_reset_progress();
-	pad = s->len - (int64_t)last_block * s->block_size;
-	if (pad < 0) {
-		return -1;
-	}
-	if (pad > 0) {
-		write_skip_chunk(out, pad);
-	}
-
-	return 0;
-}
 
-int named_file_write_ext4_sparse(const char *filename, const char *what)
-{
-	int infd = -1;
-	int outfd = -1;
-	int ret = -1;
-	struct sparse_file *s;
-	int chunks;
-	struct output_file *out;
+	if (ret)
+		image_writer_abort(&iw);
+	else
+		ret = image_writer_finish(&iw);
 
-	outfd = open(filename, O_WRONLY);
-	if (outfd < 0) {
-		pr_error("Couldn't open destination file %s\n", filename);
-		goto out;
-	}
-	infd = open(what, O_RDONLY);
-	if (infd < 0) {
-		pr_error("Couldn't open sparse input file\n");
-		goto out;
-	}
+	if (blkwriter_close(bw))
+		ret = -1;
+	return ret;
+}
 
-	pr_verbose("Importing sparse file data\n");
-	s = sparse_file_import(infd, true, false);
-	if (!s) {
-		pr_error("Couldn't import sparse file data\n");
-		goto out;
-	}
 
-	pr_verbose("Writing sparse file data\n");
+static int write_decompressed(void *ctx, const void *buf, size_t len)
+{
+	return image_writer_write(ctx, buf, len);
+}
 
-	chunks = sparse_count_chunks(s);
-	out = output_file_open_fd(outfd, s->block_size, s->len,
-			false, false, chunks, false);
-	if (!out)
-		die_errno("malloc");
+/* Expand a compressed raw or sparse image into filename, which must
+ * already exist and hold at most vsize bytes */
+int named_file_write_decompress(const char *filename, struct data_window *dw,
+		uint64_t vsize, unsigned flags)
+{
+	struct image_writer iw;
+	struct blkwriter *bw;
+	int ret;
 
-	ret = write_all_blocks(s, out);
-	output_file_close(out);
+	bw = blkwriter_open(filename);
+	if (!bw)
+		return -1;
 
-	if (ret < 0)
-		pr_error("Couldn't write output file");
+	image_writer_init(&iw, bw, vsize);
+	if (setup_image_writer(&iw, filename, flags)) {
+		blkwriter_close(bw);
+		return -1;
+	}
+	ret = decompress_image(dw, write_decompressed, &iw);
+	if (ret)
+		image_writer_abort(&iw);
 	else
-		ret = 0;
-
-	pr_verbose("Destroying sparse data stucture\n");
-	sparse_file_destroy(s);
-	fsync(outfd);
-out:
-	if (infd >= 0)
-		close(infd);
-	if (outfd >= 0)
-		close(outfd);
+		ret = image_writer_finish(&iw);
 
+	if (blkwriter_close(bw))
+		ret = -1;
 	return ret;
 }
 
@@ -530,163 +480,49 @@ int unmount_partition(struct fstab_rec *vol)
 	return ret;
 }
 
-enum erase_type {
-	SECDISCARD,
-	DISCARD,
-	ZERO
-};
-
-/* more or less arbitrary value */
-#define ZEROES_ARRAY_SZ	4096U
-
-static int erase_range_zero(int fd, uint64_t start, uint64_t len)
+static int erase_volume(struct fstab_rec *vol, enum erase_policy policy)
 {
-	char zeroes[ZEROES_ARRAY_SZ];
-
-	memset(zeroes, 0, ZEROES_ARRAY_SZ);
-
-	if (lseek64(fd, start, SEEK_SET) < 0) {
-		pr_perror("lseek64");
-		return -1;
-	}
-
-	while (len) {
-		ssize_t ret;
-
-		ret = write(fd, zeroes, min(len, ZEROES_ARRAY_SZ));
-		if (ret < 0) {
-			pr_perror("write");
-			return -1;
-		}
-		len -= ret;
-	}
-	return 0;
-}
-
-static int erase_range(int fd, uint64_t start, uint64_t len)
-{
-	uint64_t range[2];
-	int ret;
-	static enum erase_type etype = SECDISCARD;
-
-	pr_debug("erasing offset %" PRIu64 " len %" PRIu64 "\n", start, len);
-	switch (etype) {
-	case SECDISCARD:
-		range[0] = start;
-		range[1] = len;
-
-		ret = ioctl(fd, BLKSECDISCARD, &range);
-		if (ret >= 0)
-			break;
-		pr_info("BLKSECDISCARD didn't work, trying BLKDISCARD (%d:%s)\n",
-				errno, strerror(errno));
-		etype = DISCARD;
-		/* fall through */
-	case DISCARD:
-		range[0] = start;
-		range[1] = len;
-
-		ret = ioctl(fd, BLKDISCARD, &range);
-		if (ret >= 0)
-			break;
-		pr_info("BLKDISCARD didn't work, fall back to zeroing out (%d:%s)\n",
-				errno, strerror(errno));
-		pr_info("This can take a LONG time!\n");
-		etype = ZERO;
-		/* Fall through */
-	case ZERO:
-		return erase_range_zero(fd, start, len);
-	}
-
-	return 0;
-}
-
-static char *get_disk_sysfs(char *node)
-{
-	struct stat sb;
-	if (stat(node, &sb)) {
-		pr_perror("stat");
-		return NULL;
-	}
-
-	return xasprintf("/sys/dev/block/%d:0/", major(sb.st_rdev));
-}
-
-#define MAX_INCREMENT 5LL * 1024LL * 1024LL * 1024LL
-
-int erase_partition(struct fstab_rec *vol)
-{
-	int64_t disk_size;
+	uint64_t disk_size;
 	int fd;
 	int ret = -1;
-	int64_t increment;
-	int64_t pos;
-	int64_t max_bytes;
-	char *disk_name = NULL;
 
 	if (!is_valid_blkdev(vol->blk_device)) {
 		pr_error("invalid destination node. partition disks?\n");
 		return -1;
 	}
-	get_volume_size(vol, (uint64_t *)&disk_size);
+	if (get_volume_size(vol, &disk_size))
+		return -1;
 	fd = open(vol->blk_device, O_RDWR);
 	if (fd < 0) {
 		pr_error("couldn't open block device %s\n", vol->blk_device);
 		return -1;
 	}
 
-	mui_show_indeterminate_progress();
-	/* It would be great if we could do BLKSECDISCARD on small regions
-	 * so that we can update the progress bar, but each of these ioctls
-	 * has a very long setup/teardown phase which makes the entire operation
-	 * much slower if we call multiple times on small areas */
-	disk_name = get_disk_sysfs(vol->blk_device);
-	if (!disk_name) {
-		pr_error("Couldn't get disk major number for %s\n", vol->blk_device);
-		goto out;
-	}
-
-	if (read_sysfs_int64(&max_bytes, "%s/queue/discard_max_bytes", disk_name)) {
-		pr_error("Couldn't read %s/queue/discard_max_bytes, is kernel configured correctly?\n",
-				disk_name);
-		pr_info("Fallback to manual zero of partition, this can take a LONG time\n");
-		ret = erase_range_zero(fd, 0, disk_size);
-		mui_show_text(0);
+	mui_show_progress(1.0, 0);
+	if (erase_range(fd, 0, disk_size, policy, NULL, NULL)) {
+		pr_error("Disk erase operation failed\n");
 		goto out;
 	}
-	pr_debug("max bytes: %" PRId64"\n", max_bytes);
-
-
-	if (max_bytes && disk_size > max_bytes)
-		increment = max_bytes;
-	else
-		increment = disk_size;
-
-	increment = min(increment, MAX_INCREMENT);
-
-	if (increment != disk_size)
-		mui_show_progress(1.0, 0);
-
-	pos = 0;
-	while (pos < disk_size) {
-		mui_set_progress((float)pos / (float)disk_size);
-		if (pos + increment > disk_size)
-			increment = disk_size - pos;
-		if (erase_range(fd, pos, increment)) {
-			pr_error("Disk erase operation failed\n");
-			goto out;
-		}
-		pos += increment;
-	}
 	ret = 0;
 out:
 	mui_reset_progress();
-	free(disk_name);
 	fsync(fd);
 	close(fd);
 	return ret;
 }
 
+int erase_partition(struct fstab_rec *vol)
+{
+	return erase_volume(vol, volume_erase_policy(vol));
+}
+
+/* Wipes that protect user data on a device state change can't be
+ * weakened by the fstab */
+int wipe_partition(struct fstab_rec *vol)
+{
+	return erase_volume(vol, ERASE_POLICY_SECURE);
+}
+
 
 int execute_command(const char *fmt, ...)
 {
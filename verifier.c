@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <zlib.h>
+
+#include "verifier.h"
+#include "userfastboot_ui.h"
+#include "userfastboot_util.h"
+
+/* Data is checked in pieces of at most VERIFY_CHUNK, and up to
+ * VERIFY_QUEUE pieces wait for readback before the writer is held up */
+#define VERIFY_CHUNK		(1024 * 1024)
+#define VERIFY_QUEUE		64
+#define VERIFY_MEM_ALIGN	4096
+
+struct verify_entry {
+	uint64_t offset;
+	uint64_t len;
+	/* Readable once the blkwriter has retired this many bytes */
+	uint64_t ready;
+	bool fill;
+	/* Fill pattern, or CRC32 of the data */
+	uint32_t value;
+};
+
+struct verifier {
+	struct blkwriter *bw;
+	int fd;
+	bool direct;
+	size_t align;
+	unsigned char *buf;
+	unsigned char *fill_buf;
+	bool fill_valid;
+	uint32_t fill_val;
+	pthread_t thread;
+	bool running;
+
+	/* Writer side: contiguous data collected into one entry */
+	struct verify_entry cur;
+	bool cur_open;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct verify_entry queue[VERIFY_QUEUE];
+	unsigned head;
+	unsigned count;
+	uint64_t retired;
+	bool closing;
+	bool stop;
+	bool failed;
+	uint64_t bad_offset;
+	uint64_t verified;
+};
+
+
+/* Read len bytes at offset into v->buf, widened to what O_DIRECT
+ * accepts. Returns where the requested bytes start. */
+static const unsigned char *read_back(struct verifier *v, uint64_t offset,
+		size_t len)
+{
+	uint64_t start = offset - offset % v->align;
+	size_t head = offset - start;
+	size_t want = (head + len + v->align - 1) / v->align * v->align;
+	size_t got = 0;
+
+	while (got < head + len) {
+		ssize_t r = pread64(v->fd, v->buf + got, want - got,
+				start + got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL && v->direct) {
+			int flags = fcntl(v->fd, F_GETFL);
+
+			pr_debug("verifier: O_DIRECT refused, reading buffered\n");
+			if (flags >= 0 && !fcntl(v->fd, F_SETFL,
+						flags & ~O_DIRECT)) {
+				v->direct = false;
+				continue;
+			}
+		}
+		if (r <= 0) {
+			pr_error("verify read at %" PRIu64 " failed: %s\n",
+					start + got,
+					r ? strerror(errno) : "end of device");
+			return NULL;
+		}
+		got += r;
+	}
+	return v->buf + head;
+}
+
+
+/* Returns 0 if the range matches, otherwise sets *bad */
+static int check_entry(struct verifier *v, const struct verify_entry *e,
+		uint64_t *bad)
+{
+	uint32_t crc = crc32(0, NULL, 0);
+	uint64_t pos = 0;
+	size_t i;
+
+	if (e->fill && (!v->fill_valid || v->fill_val != e->value)) {
+		uint32_t *words = (uint32_t *)v->fill_buf;
+
+		for (i = 0; i < VERIFY_CHUNK / sizeof(*words); i++)
+			words[i] = e->value;
+		v->fill_val = e->value;
+		v->fill_valid = true;
+	}
+
+	while (pos < e->len) {
+		size_t n = min(e->len - pos, (uint64_t)VERIFY_CHUNK);
+		const unsigned char *p;
+
+		p = read_back(v, e->offset + pos, n);
+		if (!p) {
+			*bad = e->offset + pos;
+			return -1;
+		}
+
+		if (!e->fill) {
+			crc = crc32(crc, p, n);
+		} else if (memcmp(p, v->fill_buf, n)) {
+			for (i = 0; p[i] == v->fill_buf[i]; i++)
+				;
+			*bad = e->offset + pos + i;
+			return -1;
+		}
+		pos += n;
+	}
+
+	if (!e->fill && crc != e->value) {
+		*bad = e->offset;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void *verify_thread(void *arg)
+{
+	struct verifier *v = arg;
+	struct verify_entry e;
+	uint64_t bad;
+	int ret;
+
+	pthread_mutex_lock(&v->lock);
+	while (!v->stop && !v->failed) {
+		if (!v->count) {
+			if (v->closing)
+				break;
+			pthread_cond_wait(&v->cond, &v->lock);
+			continue;
+		}
+		e = v->queue[v->head];
+		if (e.ready > v->retired) {
+			pthread_cond_wait(&v->cond, &v->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&v->lock);
+		ret = check_entry(v, &e, &bad);
+		pthread_mutex_lock(&v->lock);
+
+		if (ret) {
+			v->failed = true;
+			v->bad_offset = bad;
+		} else {
+			v->verified += e.len;
+		}
+		v->head = (v->head + 1) % VERIFY_QUEUE;
+		v->count--;
+		pthread_cond_broadcast(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+	return NULL;
+}
+
+
+static void verify_retired(void *ctx, uint64_t retired)
+{
+	struct verifier *v = ctx;
+
+	pthread_mutex_lock(&v->lock);
+	v->retired = retired;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+}
+
+
+static int publish(struct verifier *v, const struct verify_entry *e)
+{
+	int ret;
+
+	pthread_mutex_lock(&v->lock);
+	while (v->count == VERIFY_QUEUE && !v->failed && !v->stop) {
+		if (v->queue[v->head].ready <= v->retired) {
+			pthread_cond_wait(&v->cond, &v->lock);
+			continue;
+		}
+		/* The oldest entry is still sitting in the blkwriter, and
+		 * only we can move it along */
+		pthread_mutex_unlock(&v->lock);
+		ret = blkwriter_flush(v->bw);
+		pthread_mutex_lock(&v->lock);
+		if (ret)
+			v->stop = true;
+	}
+
+	if (!v->failed && !v->stop) {
+		v->queue[(v->head + v->count) % VERIFY_QUEUE] = *e;
+		v->count++;
+		pthread_cond_broadcast(&v->cond);
+	}
+	ret = (v->failed || v->stop) ? -1 : 0;
+	pthread_mutex_unlock(&v->lock);
+	return ret;
+}
+
+
+static int publish_cur(struct verifier *v)
+{
+	v->cur_open = false;
+	v->cur.ready = blkwriter_queued(v->bw);
+	return publish(v, &v->cur);
+}
+
+
+struct verifier *verifier_start(const char *filename, struct blkwriter *bw)
+{
+	struct verifier *v;
+	int ssz;
+
+	v = xmalloc(sizeof(*v));
+	memset(v, 0, sizeof(*v));
+	v->bw = bw;
+
+	v->fd = open(filename, O_RDONLY | O_DIRECT);
+	v->direct = v->fd >= 0;
+	if (v->fd < 0)
+		v->fd = open(filename, O_RDONLY);
+	if (v->fd < 0) {
+		pr_error("Couldn't open %s for reading: %s\n", filename,
+				strerror(errno));
+		free(v);
+		return NULL;
+	}
+
+	if (ioctl(v->fd, BLKSSZGET, &ssz) || ssz <= 0)
+		ssz = VERIFY_MEM_ALIGN;
+	v->align = ssz;
+	if (posix_memalign((void **)&v->buf, max(v->align,
+				(size_t)VERIFY_MEM_ALIGN),
+				VERIFY_CHUNK + 2 * v->align))
+		die_errno("posix_memalign");
+	v->fill_buf = xmalloc(VERIFY_CHUNK);
+
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+	v->retired = blkwriter_queued(bw);
+	if (pthread_create(&v->thread, NULL, verify_thread, v)) {
+		pr_error("Couldn't start verify thread\n");
+		verifier_abort(v);
+		return NULL;
+	}
+	v->running = true;
+	blkwriter_set_retire_cb(bw, verify_retired, v);
+	return v;
+}
+
+
+int verifier_data(struct verifier *v, const void *data, size_t len,
+		uint64_t offset)
+{
+	const unsigned char *buf = data;
+
+	while (len) {
+		size_t n;
+
+		if (v->cur_open && (offset != v->cur.offset + v->cur.len ||
+					v->cur.len == VERIFY_CHUNK) &&
+				publish_cur(v))
+			return -1;
+
+		if (!v->cur_open) {
+			memset(&v->cur, 0, sizeof(v->cur));
+			v->cur.offset = offset;
+			v->cur.value = crc32(0, NULL, 0);
+			v->cur_open = true;
+		}
+
+		n = min(len, VERIFY_CHUNK - (size_t)v->cur.len);
+		v->cur.value = crc32(v->cur.value, buf, n);
+		v->cur.len += n;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+int verifier_fill(struct verifier *v, uint64_t offset, uint64_t len,
+		uint32_t value)
+{
+	struct verify_entry e = {
+		.offset = offset,
+		.len = len,
+		.fill = true,
+		.value = value,
+	};
+
+	if (v->cur_open && publish_cur(v))
+		return -1;
+	e.ready = blkwriter_queued(v->bw);
+	return publish(v, &e);
+}
+
+
+static void verifier_free(struct verifier *v)
+{
+	if (v->running)
+		pthread_join(v->thread, NULL);
+	blkwriter_set_retire_cb(v->bw, NULL, NULL);
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->cond);
+	close(v->fd);
+	free(v->buf);
+	free(v->fill_buf);
+	free(v);
+}
+
+
+int verifier_finish(struct verifier *v)
+{
+	int ret = 0;
+
+	if (v->cur_open)
+		publish_cur(v);
+	/* Write errors have been reported already */
+	if (blkwriter_flush(v->bw))
+		ret = -1;
+
+	pthread_mutex_lock(&v->lock);
+	if (ret)
+		v->stop = true;
+	v->closing = true;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	pthread_join(v->thread, NULL);
+	v->running = false;
+
+	if (v->failed) {
+		pr_error("verify failed at offset 0x%" PRIx64 "\n",
+				v->bad_offset);
+		ret = -1;
+	} else if (!ret) {
+		pr_info("Verified %" PRIu64 " bytes\n", v->verified);
+	}
+	verifier_free(v);
+	return ret;
+}
+
+
+void verifier_abort(struct verifier *v)
+{
+	pthread_mutex_lock(&v->lock);
+	v->stop = true;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	verifier_free(v);
+}
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */
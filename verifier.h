@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USERFASTBOOT_VERIFIER_H_
+#define _USERFASTBOOT_VERIFIER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blkwriter.h"
+
+/* Checks what a blkwriter put on the device while the flash is still
+ * going. The writer side notes a CRC32 of each range it hands to the
+ * blkwriter, and a thread reads the range back with O_DIRECT once the
+ * blkwriter reports it written, lagging only as far behind as the
+ * writes in flight. Fills are checked against their pattern directly.
+ *
+ * The writer side calls must come from the thread using bw. */
+struct verifier;
+
+struct verifier *verifier_start(const char *filename, struct blkwriter *bw);
+
+/* Note len bytes of data that were just queued at offset. Returns -1
+ * once a mismatch has been found, so the flash can stop early. */
+int verifier_data(struct verifier *v, const void *data, size_t len,
+		uint64_t offset);
+
+/* Same for a range filled with a 32 bit pattern */
+int verifier_fill(struct verifier *v, uint64_t offset, uint64_t len,
+		uint32_t value);
+
+/* Flush bw, wait for the readback to catch up and free everything.
+ * Returns -1 if anything didn't match or couldn't be read back. */
+int verifier_finish(struct verifier *v);
+
+/* Stop without checking the rest, after a failed write */
+void verifier_abort(struct verifier *v);
+
+#endif
+
+/* vim: cindent:noexpandtab:softtabstop=8:shiftwidth=8:noshiftround
+ */